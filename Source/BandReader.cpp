@@ -0,0 +1,538 @@
+#include "BandReader.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <png.h>
+#include "HalfFloat.h"
+
+/* Large sources are bigger than a long on Windows */
+static bool Seek(FILE * file, uint64_t offset)
+{
+#if defined(_WIN32)
+  return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+  return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t Tell(FILE * file)
+{
+#if defined(_WIN32)
+  return (uint64_t)_ftelli64(file);
+#else
+  return (uint64_t)ftello(file);
+#endif
+}
+
+/* Radiance RGBE, run length encoded or flat scanlines. Follows stb_image,
+   which only expects run length encoding for widths of 8 to 32767. */
+class RadianceReader : public BandReader
+{
+public:
+  RadianceReader(FILE * file, bool hdr) :
+    BandReader(file, hdr),
+    flat(false)
+  {
+  }
+
+  bool ReadHeader()
+  {
+    std::string token = ReadLine();
+    if (token != "#?RADIANCE" && token != "#?RGBE") {
+      return false;
+    }
+
+    bool valid = false;
+    while (1) {
+      token = ReadLine();
+      if (token.empty()) {
+        break;
+      }
+      if (token == "FORMAT=32-bit_rle_rgbe") {
+        valid = true;
+      }
+    }
+
+    if (!valid) {
+      return false;
+    }
+
+    token = ReadLine();
+    if (sscanf(token.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0) {
+      return false;
+    }
+
+    channels = 3;
+    flat = width < 8 || width >= 32768;
+    rgbe.resize(width * 4);
+    row.resize(width * 4);
+    return true;
+  }
+
+  bool ReadRow(uint8_t * dst) override
+  {
+    if (flat) {
+      if (fread(rgbe.data(), 4, width, file) != (size_t)width) {
+        return false;
+      }
+    } else {
+      uint8_t start[4];
+      if (fread(start, 1, 4, file) != 4) {
+        return false;
+      }
+
+      if (start[0] != 2 || start[1] != 2 || (start[2] & 0x80)) {
+        /* Not run length encoded after all, the rest of the file is flat */
+        flat = true;
+        memcpy(rgbe.data(), start, 4);
+        if (width > 1 && fread(rgbe.data() + 4, 4, width - 1, file) != (size_t)(width - 1)) {
+          return false;
+        }
+      } else {
+        if (((start[2] << 8) | start[3]) != width) {
+          return false;
+        }
+
+        for (int channel = 0; channel < 4; channel++) {
+          int x = 0;
+          while (x < width) {
+            int count = fgetc(file);
+            if (count == EOF) {
+              return false;
+            }
+
+            if (count > 128) {
+              int value = fgetc(file);
+              count -= 128;
+              if (value == EOF || count > width - x) {
+                return false;
+              }
+              for (int i = 0; i < count; i++) {
+                rgbe[(x++) * 4 + channel] = (uint8_t)value;
+              }
+            } else {
+              if (count == 0 || count > width - x) {
+                return false;
+              }
+              for (int i = 0; i < count; i++) {
+                int value = fgetc(file);
+                if (value == EOF) {
+                  return false;
+                }
+                rgbe[(x++) * 4 + channel] = (uint8_t)value;
+              }
+            }
+          }
+        }
+      }
+    }
+
+    for (int x = 0; x < width; x++) {
+      const uint8_t * pixel = &rgbe[x * 4];
+      float scale = pixel[3] != 0 ? (float)ldexp(1.0f, pixel[3] - (int)(128 + 8)) : 0.0f;
+      row[x * 4 + 0] = pixel[0] * scale;
+      row[x * 4 + 1] = pixel[1] * scale;
+      row[x * 4 + 2] = pixel[2] * scale;
+      row[x * 4 + 3] = 1.0f;
+    }
+
+    StoreRow(row.data(), dst);
+    return true;
+  }
+
+private:
+  std::string ReadLine()
+  {
+    std::string line;
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n') {
+      line += (char)c;
+    }
+    return line;
+  }
+
+  bool flat;
+  std::vector<uint8_t> rgbe;
+  std::vector<float> row;
+};
+
+/* Binary PGM (P5), PPM (P6) with 8 or 16 bit samples, and PFM (Pf/PF), whose
+   rows are stored bottom to top and so are read back to front. */
+class PnmReader : public BandReader
+{
+public:
+  PnmReader(FILE * file, bool hdr) :
+    BandReader(file, hdr),
+    isFloat(false),
+    littleEndian(false),
+    wide(false),
+    dataStart(0),
+    y(0)
+  {
+  }
+
+  bool ReadHeader()
+  {
+    int p = fgetc(file);
+    int t = fgetc(file);
+    if (p != 'P') {
+      return false;
+    }
+
+    if (t == '5' || t == '6') {
+      channels = t == '6' ? 3 : 1;
+    } else if (t == 'f' || t == 'F') {
+      channels = t == 'F' ? 3 : 1;
+      isFloat = true;
+    } else {
+      return false;
+    }
+
+    int c = fgetc(file);
+    width = ReadInteger(c);
+    height = ReadInteger(c);
+    if (width <= 0 || height <= 0) {
+      return false;
+    }
+
+    if (isFloat) {
+      /* The scale's sign gives the byte order, the rest of the line is skipped */
+      std::string scale;
+      SkipWhitespace(c);
+      while (c != EOF && c != '\n' && c != '\r') {
+        scale += (char)c;
+        c = fgetc(file);
+      }
+      littleEndian = atof(scale.c_str()) < 0.0;
+    } else {
+      /* Above 255 samples are 16 bit big endian */
+      int maxValue = ReadInteger(c);
+      if (maxValue <= 0 || maxValue > 65535) {
+        return false;
+      }
+      wide = maxValue > 255;
+    }
+
+    /* A single whitespace character separates the header from the data */
+    dataStart = Tell(file);
+    samples.resize(width * channels * (isFloat ? sizeof(float) : wide ? 2 : 1));
+    ldrRow.resize(width * 4);
+    wideRow.resize(wide ? width * 4 : 0);
+    hdrRow.resize(width * 4);
+    return true;
+  }
+
+  bool ReadRow(uint8_t * dst) override
+  {
+    if (isFloat) {
+      uint64_t rowBytes = (uint64_t)width * channels * sizeof(float);
+      if (!Seek(file, dataStart + (uint64_t)(height - 1 - y) * rowBytes) || fread(samples.data(), 1, samples.size(), file) != samples.size()) {
+        return false;
+      }
+
+      uint16_t test = 1;
+      bool nativeLittleEndian = *(uint8_t *)&test == 1;
+      if (littleEndian != nativeLittleEndian) {
+        for (size_t i = 0; i < samples.size(); i += 4) {
+          std::swap(samples[i], samples[i + 3]);
+          std::swap(samples[i + 1], samples[i + 2]);
+        }
+      }
+
+      const float * values = (const float *)samples.data();
+      for (int x = 0; x < width; x++) {
+        for (int channel = 0; channel < 3; channel++) {
+          hdrRow[x * 4 + channel] = values[x * channels + (channels == 3 ? channel : 0)];
+        }
+        hdrRow[x * 4 + 3] = 1.0f;
+      }
+
+      StoreRow(hdrRow.data(), dst);
+    } else if (wide) {
+      if (fread(samples.data(), 1, samples.size(), file) != samples.size()) {
+        return false;
+      }
+
+      for (int x = 0; x < width; x++) {
+        for (int channel = 0; channel < 3; channel++) {
+          const uint8_t * sample = &samples[(x * channels + (channels == 3 ? channel : 0)) * 2];
+          wideRow[x * 4 + channel] = (uint16_t)((sample[0] << 8) | sample[1]);
+        }
+        wideRow[x * 4 + 3] = 65535;
+      }
+
+      StoreRow(wideRow.data(), dst);
+    } else {
+      if (fread(samples.data(), 1, samples.size(), file) != samples.size()) {
+        return false;
+      }
+
+      for (int x = 0; x < width; x++) {
+        for (int channel = 0; channel < 3; channel++) {
+          ldrRow[x * 4 + channel] = samples[x * channels + (channels == 3 ? channel : 0)];
+        }
+        ldrRow[x * 4 + 3] = 255;
+      }
+
+      StoreRow(ldrRow.data(), dst);
+    }
+
+    y++;
+    return true;
+  }
+
+private:
+  void SkipWhitespace(int & c)
+  {
+    while (1) {
+      while (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r') {
+        c = fgetc(file);
+      }
+
+      if (c != '#') {
+        break;
+      }
+
+      while (c != EOF && c != '\n' && c != '\r') {
+        c = fgetc(file);
+      }
+    }
+  }
+
+  int ReadInteger(int & c)
+  {
+    SkipWhitespace(c);
+
+    int value = 0;
+    while (c >= '0' && c <= '9') {
+      if (value > 214748363) {
+        return 0;
+      }
+      value = value * 10 + (c - '0');
+      c = fgetc(file);
+    }
+    return value;
+  }
+
+  bool isFloat;
+  bool littleEndian;
+  bool wide;
+  uint64_t dataStart;
+  int y;
+  std::vector<uint8_t> samples;
+  std::vector<uint8_t> ldrRow;
+  std::vector<uint16_t> wideRow;
+  std::vector<float> hdrRow;
+};
+
+/* PNG through libpng's row by row reader, expanded to RGBA the way stb_image
+   does. Interlaced images only complete their first row with the last pass,
+   so they aren't streamed. libpng reports errors with longjmp, so nothing
+   with a destructor is created after the setjmp calls. */
+class PngReader : public BandReader
+{
+public:
+  PngReader(FILE * file, bool hdr) :
+    BandReader(file, hdr),
+    png(nullptr),
+    info(nullptr),
+    wide(false)
+  {
+  }
+
+  ~PngReader()
+  {
+    png_destroy_read_struct(&png, &info, nullptr);
+  }
+
+  bool ReadHeader()
+  {
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, Error, Warning);
+    if (png == nullptr) {
+      return false;
+    }
+
+    info = png_create_info_struct(png);
+    if (info == nullptr) {
+      return false;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+      return false;
+    }
+
+    png_init_io(png, file);
+    png_read_info(png, info);
+
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE || png_get_image_width(png, info) > 0x7FFFFFFF || png_get_image_height(png, info) > 0x7FFFFFFF) {
+      return false;
+    }
+
+    int colorType = png_get_color_type(png, info);
+    bool alpha = (colorType & PNG_COLOR_MASK_ALPHA) != 0 || png_get_valid(png, info, PNG_INFO_tRNS) != 0;
+    width = (int)png_get_image_width(png, info);
+    height = (int)png_get_image_height(png, info);
+    channels = ((colorType & PNG_COLOR_MASK_COLOR) != 0 ? 3 : 1) + (alpha ? 1 : 0);
+    wide = png_get_bit_depth(png, info) == 16;
+
+    /* Palettes, low bit depths and tRNS expand to 8 or 16 bit RGBA */
+    png_set_expand(png);
+    png_set_gray_to_rgb(png);
+    if (!alpha) {
+      png_set_filler(png, wide ? 0xFFFF : 0xFF, PNG_FILLER_AFTER);
+    }
+    png_read_update_info(png, info);
+
+    if (png_get_rowbytes(png, info) != (size_t)width * 4 * (wide ? 2 : 1)) {
+      return false;
+    }
+
+    samples.resize(png_get_rowbytes(png, info));
+    wideRow.resize(wide ? width * 4 : 0);
+    return true;
+  }
+
+  bool ReadRow(uint8_t * dst) override
+  {
+    if (setjmp(png_jmpbuf(png))) {
+      return false;
+    }
+
+    png_read_row(png, samples.data(), nullptr);
+
+    if (wide) {
+      for (int x = 0; x < width * 4; x++) {
+        wideRow[x] = (uint16_t)((samples[x * 2] << 8) | samples[x * 2 + 1]);
+      }
+      StoreRow(wideRow.data(), dst);
+    } else {
+      StoreRow(samples.data(), dst);
+    }
+    return true;
+  }
+
+private:
+  static void Error(png_structp png, png_const_charp message)
+  {
+    png_longjmp(png, 1);
+  }
+
+  static void Warning(png_structp png, png_const_charp message)
+  {
+  }
+
+  png_structp png;
+  png_infop info;
+  bool wide;
+  std::vector<uint8_t> samples;
+  std::vector<uint16_t> wideRow;
+};
+
+BandReader::BandReader(FILE * file, bool hdr) :
+  file(file),
+  hdr(hdr),
+  width(0),
+  height(0),
+  channels(0)
+{
+}
+
+BandReader::~BandReader()
+{
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+std::unique_ptr<BandReader> BandReader::Open(const std::string & path, bool hdr)
+{
+  FILE * file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return nullptr;
+  }
+
+  uint8_t magic[8] = {0};
+  size_t magicLength = fread(magic, 1, 8, file);
+  rewind(file);
+
+  if (magicLength >= 2 && magic[0] == '#' && magic[1] == '?') {
+    std::unique_ptr<RadianceReader> reader(new RadianceReader(file, hdr));
+    if (reader->ReadHeader()) {
+      return reader;
+    }
+    return nullptr;
+  }
+
+  if (magicLength >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6' || magic[1] == 'f' || magic[1] == 'F')) {
+    std::unique_ptr<PnmReader> reader(new PnmReader(file, hdr));
+    if (reader->ReadHeader()) {
+      return reader;
+    }
+    return nullptr;
+  }
+
+  if (magicLength == 8 && png_sig_cmp(magic, 0, 8) == 0) {
+    std::unique_ptr<PngReader> reader(new PngReader(file, hdr));
+    if (reader->ReadHeader()) {
+      return reader;
+    }
+    return nullptr;
+  }
+
+  /* Decoding anything else would need the whole image in memory */
+  fclose(file);
+  return nullptr;
+}
+
+void BandReader::StoreRow(const uint8_t * rgba, uint8_t * dst) const
+{
+  if (!hdr) {
+    memcpy(dst, rgba, width * 4);
+    return;
+  }
+
+  /* Same as stbi_loadf on an LDR image, gamma 2.2 colour and linear alpha */
+  uint16_t * halfs = (uint16_t *)dst;
+  for (int x = 0; x < width * 4; x++) {
+    float value = x % 4 == 3 ? rgba[x] / 255.0f : powf(rgba[x] / 255.0f, 2.2f);
+    halfs[x] = HalfFloat::FromFloat(value);
+  }
+}
+
+void BandReader::StoreRow(const uint16_t * rgba, uint8_t * dst) const
+{
+  /* stb_image keeps the high byte of 16 bit samples */
+  if (!hdr) {
+    for (int x = 0; x < width * 4; x++) {
+      dst[x] = (uint8_t)(rgba[x] >> 8);
+    }
+    return;
+  }
+
+  /* Gamma 2.2 colour and linear alpha as for 8 bit samples, but from all
+     16 bits */
+  uint16_t * halfs = (uint16_t *)dst;
+  for (int x = 0; x < width * 4; x++) {
+    float value = x % 4 == 3 ? rgba[x] / 65535.0f : powf(rgba[x] / 65535.0f, 2.2f);
+    halfs[x] = HalfFloat::FromFloat(value);
+  }
+}
+
+void BandReader::StoreRow(const float * rgba, uint8_t * dst) const
+{
+  if (hdr) {
+    uint16_t * halfs = (uint16_t *)dst;
+    for (int x = 0; x < width * 4; x++) {
+      halfs[x] = HalfFloat::FromFloat(std::min(std::max(rgba[x], 0.0f), 65504.0f));
+    }
+    return;
+  }
+
+  /* Same as stbi_load on an HDR image, gamma 1/2.2 colour and linear alpha */
+  for (int x = 0; x < width * 4; x++) {
+    float value = x % 4 == 3 ? rgba[x] : powf(rgba[x], 1.0f / 2.2f);
+    value = value * 255 + 0.5f;
+    dst[x] = (uint8_t)std::min(std::max(value, 0.0f), 255.0f);
+  }
+}
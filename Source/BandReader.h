@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Decodes an image a row at a time, top to bottom, so the whole image never
+   has to be in memory. Radiance HDR, binary PGM/PPM (8 or 16 bit), PFM and
+   non-interlaced PNG can be read this way, other formats can't be opened.
+   Rows come out in the level format: RGBA8, or RGBA16F clamped to the BC6H
+   range for HDR, converted the same way stb_image does when the source is
+   the other kind. */
+class BandReader
+{
+public:
+  /* Reads just the header, returns nullptr if the file can't be opened or
+     isn't one of the formats above. */
+  static std::unique_ptr<BandReader> Open(const std::string & path, bool hdr);
+
+  virtual ~BandReader();
+
+  int Width() const { return width; }
+  int Height() const { return height; }
+  int Channels() const { return channels; }
+
+  /* Decodes the next row into dst */
+  virtual bool ReadRow(uint8_t * dst) = 0;
+
+protected:
+  BandReader(FILE * file, bool hdr);
+
+  /* Convert a decoded RGBA row to the level format */
+  void StoreRow(const uint8_t * rgba, uint8_t * dst) const;
+  void StoreRow(const uint16_t * rgba, uint8_t * dst) const;
+  void StoreRow(const float * rgba, uint8_t * dst) const;
+
+  FILE * file;
+  bool hdr;
+  int width;
+  int height;
+  int channels;
+};
@@ -0,0 +1,74 @@
+#include "BlockCache.h"
+#include <algorithm>
+#include <cstring>
+
+BlockCache::BlockCache(size_t keySize, size_t blockSize) :
+  keySize(keySize),
+  blockSize(blockSize),
+  shards(new Shard[1 << shardBits]),
+  blocks(0),
+  duplicates(0)
+{
+}
+
+uint64_t BlockCache::Hash(const uint8_t * key, size_t size)
+{
+  /* Keys of the odd ASTC footprints end in a partial word */
+  uint64_t hash = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, key + i, std::min<size_t>(8, size - i));
+    hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 32;
+  }
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  return hash ^ (hash >> 29);
+}
+
+bool BlockCache::Find(uint64_t hash, const uint8_t * key, uint8_t * block)
+{
+  Shard & shard = shards[hash >> (64 - shardBits)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto found = shard.offsets.find(hash);
+  if (found == shard.offsets.end()) {
+    return false;
+  }
+
+  /* A hash collision is treated as a miss */
+  const uint8_t * entry = shard.entries.data() + found->second;
+  if (memcmp(entry, key, keySize) != 0) {
+    return false;
+  }
+
+  memcpy(block, entry + keySize, blockSize);
+  return true;
+}
+
+void BlockCache::Insert(uint64_t hash, const uint8_t * key, const uint8_t * block)
+{
+  Shard & shard = shards[hash >> (64 - shardBits)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  if (!shard.offsets.emplace(hash, shard.entries.size()).second) {
+    return;
+  }
+
+  shard.entries.insert(shard.entries.end(), key, key + keySize);
+  shard.entries.insert(shard.entries.end(), block, block + blockSize);
+}
+
+void BlockCache::AddStats(size_t blocks, size_t duplicates)
+{
+  this->blocks += blocks;
+  this->duplicates += duplicates;
+}
+
+void BlockCache::Clear()
+{
+  for (int i = 0; i < (1 << shardBits); i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    std::unordered_map<uint64_t, size_t>().swap(shards[i].offsets);
+    std::vector<uint8_t>().swap(shards[i].entries);
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/* Compressed blocks keyed by their source texels, shared by every worker
+   compressing a level (or one level of every layer and face). Each unique
+   block is compressed once and the result copied to its duplicates. Lookups
+   are split over a set of locked shards picked by the block's hash. */
+class BlockCache
+{
+public:
+  BlockCache(size_t keySize, size_t blockSize);
+
+  BlockCache(const BlockCache &) = delete;
+  BlockCache & operator=(const BlockCache &) = delete;
+
+  size_t KeySize() const { return keySize; }
+
+  static uint64_t Hash(const uint8_t * key, size_t size);
+
+  /* Copies the compressed block for key into block if it has been seen */
+  bool Find(uint64_t hash, const uint8_t * key, uint8_t * block);
+  void Insert(uint64_t hash, const uint8_t * key, const uint8_t * block);
+
+  void AddStats(size_t blocks, size_t duplicates);
+  size_t Blocks() const { return blocks; }
+  size_t Duplicates() const { return duplicates; }
+
+  /* Frees the stored blocks, keeping the statistics */
+  void Clear();
+
+private:
+  static const int shardBits = 6;
+
+  struct Shard
+  {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, size_t> offsets;
+    std::vector<uint8_t> entries;
+  };
+
+  size_t keySize;
+  size_t blockSize;
+  std::unique_ptr<Shard[]> shards;
+
+  std::atomic<size_t> blocks;
+  std::atomic<size_t> duplicates;
+};
@@ -0,0 +1,245 @@
+#include "Calibration.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "Compressor.h"
+#include "HalfFloat.h"
+
+static const std::map<std::string, int> isaNames = {
+  {"sse4", ISPC_ISA_SSE4},
+  {"avx2", ISPC_ISA_AVX2},
+  {"avx512skx", ISPC_ISA_AVX512SKX},
+  {"avx512icl", ISPC_ISA_AVX512ICL}
+};
+
+bool ParseIsa(const std::string & name, int & isa)
+{
+  auto found = isaNames.find(name);
+  if (found == isaNames.end()) {
+    return false;
+  }
+  isa = found->second;
+  return true;
+}
+
+std::string IsaName(int isa)
+{
+  for (auto & name : isaNames) {
+    if (name.second == isa) {
+      return name.first;
+    }
+  }
+  return "unknown";
+}
+
+std::string CalibrationKey()
+{
+  unsigned int regs[4];
+  char vendor[13] = {0};
+  ISPCCpuId(0, 0, regs);
+  memcpy(vendor, &regs[1], 4);
+  memcpy(vendor + 4, &regs[3], 4);
+  memcpy(vendor + 8, &regs[2], 4);
+
+  ISPCCpuId(1, 0, regs);
+  unsigned int signature = regs[0];
+
+  char brand[49] = {0};
+  ISPCCpuId(0x80000000, 0, regs);
+  if (regs[0] >= 0x80000004) {
+    for (int i = 0; i < 3; i++) {
+      ISPCCpuId(0x80000002 + i, 0, regs);
+      memcpy(brand + i * 16, regs, 16);
+    }
+  }
+
+  std::string brandString(brand);
+  brandString.erase(0, brandString.find_first_not_of(' '));
+  brandString.erase(brandString.find_last_not_of(' ') + 1);
+
+  std::ostringstream key;
+  key << vendor << "/" << brandString << "/" << std::hex << std::setw(8) << std::setfill('0') << signature;
+  return key.str();
+}
+
+std::string CalibrationPath()
+{
+  std::filesystem::path directory;
+#if defined(_WIN32)
+  const char * localAppData = getenv("LOCALAPPDATA");
+  if (localAppData != nullptr) {
+    directory = localAppData;
+  }
+#else
+  const char * cacheHome = getenv("XDG_CACHE_HOME");
+  const char * home = getenv("HOME");
+  if (cacheHome != nullptr && cacheHome[0] != 0) {
+    directory = cacheHome;
+  } else if (home != nullptr) {
+    directory = std::filesystem::path(home) / ".cache";
+  }
+#endif
+
+  if (directory.empty()) {
+    directory = std::filesystem::temp_directory_path();
+  }
+  return (directory / "TextureTaffy" / "calibration.txt").string();
+}
+
+/* Gradients, hard edges and noise, so the encoders try a spread of modes */
+static std::vector<uint8_t> SyntheticLevel(int size, bool hdr)
+{
+  uint32_t seed = 12345;
+  auto random = [&]() {
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) & 0xff;
+  };
+
+  std::vector<uint8_t> rgba(size * size * 4);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      uint8_t * pixel = &rgba[(y * size + x) * 4];
+      int region = (x / 32 + y / 32) % 3;
+      if (region == 0) {
+        pixel[0] = (uint8_t)(x * 255 / size);
+        pixel[1] = (uint8_t)(y * 255 / size);
+        pixel[2] = (uint8_t)((x + y) * 127 / size);
+      } else if (region == 1) {
+        bool edge = (x + 2 * y) % 16 < 8;
+        pixel[0] = edge ? 230 : 20;
+        pixel[1] = edge ? 40 : 200;
+        pixel[2] = (uint8_t)random();
+      } else {
+        pixel[0] = (uint8_t)random();
+        pixel[1] = (uint8_t)random();
+        pixel[2] = (uint8_t)random();
+      }
+      pixel[3] = (uint8_t)(y < size / 2 ? 255 : random());
+    }
+  }
+
+  if (!hdr) {
+    return rgba;
+  }
+
+  std::vector<uint8_t> halfs(size * size * 4 * sizeof(uint16_t));
+  uint16_t * values = (uint16_t *)halfs.data();
+  for (size_t i = 0; i < rgba.size(); i++) {
+    values[i] = HalfFloat::FromFloat(rgba[i] / 255.0f * (i % 4 == 3 ? 1.0f : 8.0f));
+  }
+  return halfs;
+}
+
+std::map<std::string, int> Calibrate(const std::vector<std::pair<std::string, size_t>> & formats)
+{
+  const int size = 128;
+  const int runs = 3;
+  int previousIsa = ISPCIsa();
+
+  std::map<std::string, int> fastest;
+  for (auto & format : formats) {
+    Compressor compressor(format.first, format.second, 2);
+    std::vector<uint8_t> pixels = SyntheticLevel(size, compressor.Hdr());
+    int blocksWidth = size / compressor.BlockWidth();
+    int blocksHeight = size / compressor.BlockHeight();
+    std::vector<uint8_t> blocks(blocksWidth * blocksHeight * format.second);
+
+    /* Footprints that don't divide the level leave out its last texels */
+    rgba_surface level;
+    level.ptr = pixels.data();
+    level.width = blocksWidth * compressor.BlockWidth();
+    level.height = blocksHeight * compressor.BlockHeight();
+    level.stride = size * 4 * (compressor.Hdr() ? sizeof(uint16_t) : 1);
+
+    std::cout << "  " << format.first << ":";
+
+    double bestTime = 0.0;
+    for (int isa = ISPC_ISA_SSE4; isa <= ISPCSupportedIsa(); isa++) {
+      if (!ISPCSetIsa(isa)) {
+        continue;
+      }
+
+      /* Best of a few runs after a warm up */
+      compressor.CompressStrip(level, 0, blocksHeight, blocks.data());
+      double time = 0.0;
+      for (int run = 0; run < runs; run++) {
+        auto start = std::chrono::steady_clock::now();
+        compressor.CompressStrip(level, 0, blocksHeight, blocks.data());
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || elapsed < time) {
+          time = elapsed;
+        }
+      }
+
+      std::cout << " " << IsaName(isa) << " " << std::fixed << std::setprecision(2) << time << " ms";
+      if (fastest.count(format.first) == 0 || time < bestTime) {
+        fastest[format.first] = isa;
+        bestTime = time;
+      }
+    }
+
+    std::cout << " -> " << IsaName(fastest[format.first]) << std::endl;
+  }
+
+  ISPCSetIsa(previousIsa);
+  return fastest;
+}
+
+bool LoadCalibration(const std::string & path, const std::string & key, std::map<std::string, int> & isas)
+{
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  /* One "key<TAB>format<TAB>isa" line per machine and format */
+  bool found = false;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string lineKey, format, isaName;
+    int isa;
+    if (std::getline(fields, lineKey, '\t') && std::getline(fields, format, '\t') && std::getline(fields, isaName) && lineKey == key && ParseIsa(isaName, isa)) {
+      isas[format] = isa;
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool SaveCalibration(const std::string & path, const std::string & key, const std::map<std::string, int> & isas)
+{
+  /* Keep the other machines' entries */
+  std::vector<std::string> lines;
+  {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.substr(0, line.find('\t')) != key) {
+        lines.push_back(line);
+      }
+    }
+  }
+
+  for (auto & isa : isas) {
+    lines.push_back(key + "\t" + isa.first + "\t" + IsaName(isa.second));
+  }
+
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+  std::ofstream file(path, std::ios::out | std::ios::trunc);
+  if (!file.is_open()) {
+    return false;
+  }
+  for (auto & line : lines) {
+    file << line << "\n";
+  }
+  return file.good();
+}
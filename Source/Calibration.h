@@ -0,0 +1,23 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+bool ParseIsa(const std::string & name, int & isa);
+std::string IsaName(int isa);
+
+/* Identifies the machine for the calibration cache, from the CPUID vendor,
+   brand string and signature. */
+std::string CalibrationKey();
+
+/* Per user cache file, shared by every machine that sees the same home */
+std::string CalibrationPath();
+
+/* Times every supported kernel target on a small synthetic image for each
+   (format, block size) and returns the fastest target per format. */
+std::map<std::string, int> Calibrate(const std::vector<std::pair<std::string, size_t>> & formats);
+
+bool LoadCalibration(const std::string & path, const std::string & key, std::map<std::string, int> & isas);
+bool SaveCalibration(const std::string & path, const std::string & key, const std::map<std::string, int> & isas);
@@ -0,0 +1,541 @@
+#include "Compressor.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+void PadToBlocks(const rgba_surface & level, int width, int height, int bpp, int blockWidth, int blockHeight)
+{
+  rgba_surface texture = level;
+  texture.width = width;
+  texture.height = height;
+
+  int blocksWidth = level.width / blockWidth;
+  int blocksHeight = level.height / blockHeight;
+  int bytesPerPixel = bpp / 8;
+
+  /* Only the last column and row of blocks can contain padding */
+  for (int y = 0; y < blocksHeight; y++) {
+    for (int x = 0; x < blocksWidth; x++) {
+      if ((x + 1) * blockWidth <= width && (y + 1) * blockHeight <= height) {
+        continue;
+      }
+
+      rgba_surface block;
+      block.ptr = level.ptr + y * blockHeight * level.stride + x * blockWidth * bytesPerPixel;
+      block.width = blockWidth;
+      block.height = blockHeight;
+      block.stride = level.stride;
+
+      ReplicateBorders(&block, &texture, x * blockWidth, y * blockHeight, bpp);
+    }
+  }
+}
+
+/* Copies the listed blocks of a surface side by side into a one block high
+   surface, so the kernels still see full gangs. rowSize is the size of one
+   row of a block's texels. */
+static rgba_surface GatherBlocks(const rgba_surface & surface, const std::vector<unsigned int> & blocks, int blockWidth, int blockHeight, size_t rowSize, std::vector<uint8_t> & texels)
+{
+  unsigned int blocksWidth = surface.width / blockWidth;
+
+  rgba_surface packed;
+  packed.width = (int)blocks.size() * blockWidth;
+  packed.height = blockHeight;
+  packed.stride = (int)(blocks.size() * rowSize);
+  texels.resize(packed.stride * blockHeight);
+  packed.ptr = texels.data();
+
+  for (size_t i = 0; i < blocks.size(); i++) {
+    const uint8_t * block = surface.ptr + (blocks[i] / blocksWidth) * blockHeight * surface.stride + (blocks[i] % blocksWidth) * rowSize;
+    for (int y = 0; y < blockHeight; y++) {
+      memcpy(packed.ptr + y * packed.stride + i * rowSize, block + y * surface.stride, rowSize);
+    }
+  }
+
+  return packed;
+}
+
+static void ScatterBlocks(const uint8_t * packed, const std::vector<unsigned int> & blocks, size_t blockSize, uint8_t * dst)
+{
+  for (size_t i = 0; i < blocks.size(); i++) {
+    memcpy(dst + blocks[i] * blockSize, packed + i * blockSize, blockSize);
+  }
+}
+
+Compressor::Compressor(const std::string & format, size_t blockSize, int speed) :
+  format(format),
+  blockSize(blockSize),
+  copyChannels(4),
+  hdr(false),
+  refineThreshold(0.0f),
+  refinedBlocks(0),
+  nanoseconds(0),
+  measureError(false),
+  errorSum(0.0),
+  errorValues(0.0)
+{
+  if (format == "BC4" || format == "EAC_R11") {
+    copyChannels = 1;
+  } else if (format == "BC5" || format == "EAC_RG11") {
+    copyChannels = 2;
+  }
+
+  if (format.substr(0, 3) == "BC6") {
+    hdr = true;
+  }
+
+  BlockDimensions(format, blockWidth, blockHeight);
+  GetProfile(speed, profile);
+}
+
+void Compressor::BlockDimensions(const std::string & format, int & width, int & height)
+{
+  width = 4;
+  height = 4;
+  if (format.substr(0, 5) == "ASTC_") {
+    sscanf(format.c_str() + 5, "%dx%d", &width, &height);
+  }
+}
+
+void Compressor::GetProfile(int speed, Profile & profile) const
+{
+  if (speed == 4 || speed == 5) {
+    GetProfile_bc6h_veryfast(&profile.bc6h);
+  } else if (speed == 0) {
+    GetProfile_bc6h_veryslow(&profile.bc6h);
+  } else if (speed == 1) {
+    GetProfile_bc6h_slow(&profile.bc6h);
+  } else if (speed == 2) {
+    GetProfile_bc6h_basic(&profile.bc6h);
+  } else if (speed == 3) {
+    GetProfile_bc6h_fast(&profile.bc6h);
+  }
+
+  if (speed == 0 || speed == 1) {
+    GetProfile_slow(&profile.bc7[OpaqueBlock]);
+    GetProfile_alpha_slow(&profile.bc7[AlphaBlock]);
+  } else if (speed == 2) {
+    GetProfile_basic(&profile.bc7[OpaqueBlock]);
+    GetProfile_alpha_basic(&profile.bc7[AlphaBlock]);
+  } else if (speed == 3) {
+    GetProfile_fast(&profile.bc7[OpaqueBlock]);
+    GetProfile_alpha_fast(&profile.bc7[AlphaBlock]);
+  } else if (speed == 4) {
+    GetProfile_veryfast(&profile.bc7[OpaqueBlock]);
+    GetProfile_alpha_veryfast(&profile.bc7[AlphaBlock]);
+  } else if (speed == 5) {
+    GetProfile_ultrafast(&profile.bc7[OpaqueBlock]);
+    GetProfile_alpha_ultrafast(&profile.bc7[AlphaBlock]);
+  }
+
+  /* The slow ETC profile fully evaluates the best few of the 165 groupings
+     of a half block's pixels into the four modifier levels, and for ETC2
+     the best few splits of the block into two colours for the T and H
+     modes. The fast profiles instead centre each half block on its mean
+     and refine the centre from the chosen levels. */
+  if (speed <= 2) {
+    const int etcSkipThresholds[] = {24, 6, 4};
+    GetProfile_etc_slow(&profile.etc);
+    profile.etc.fastSkipTreshold = etcSkipThresholds[speed];
+  } else if (speed == 3) {
+    GetProfile_etc_fast(&profile.etc);
+  } else if (speed == 4) {
+    GetProfile_etc_fast(&profile.etc);
+    profile.etc.refineIterations = 1;
+  } else if (speed == 5) {
+    GetProfile_etc_ultrafast(&profile.etc);
+  }
+
+  /* Likewise ASTC has fast and slow profiles, which differ in how many of
+     the best ranked block modes are encoded in full. Opaque blocks use the
+     RGB profile, which doesn't rank the endpoint modes with alpha. */
+  const int astcSkipThresholds[] = {64, 32, 12, 5, 3, 2};
+  for (int c = 0; c < BlockClassCount; c++) {
+    if (c == OpaqueBlock || c == OpaqueGreyBlock) {
+      GetProfile_astc_fast(&profile.astc[c], blockWidth, blockHeight);
+    } else {
+      GetProfile_astc_alpha_fast(&profile.astc[c], blockWidth, blockHeight);
+    }
+    profile.astc[c].fastSkipTreshold = astcSkipThresholds[speed];
+  }
+
+  /* Rotating any of the equal colour channels of a greyscale block gives
+     the same result, so only the last is tried, along with no rotation when
+     there is alpha. Fully transparent blocks get the cheapest alpha profile,
+     their colour only shows through filtering. */
+  profile.bc7[OpaqueGreyBlock] = profile.bc7[OpaqueBlock];
+  profile.bc7[OpaqueGreyBlock].mode45_channel0 = 2;
+  profile.bc7[AlphaGreyBlock] = profile.bc7[AlphaBlock];
+  profile.bc7[AlphaGreyBlock].mode45_channel0 = 2;
+  GetProfile_alpha_ultrafast(&profile.bc7[TransparentBlock]);
+}
+
+void Compressor::SetRefinement(int speed, float threshold)
+{
+  GetProfile(speed, refineProfile);
+  refineThreshold = threshold;
+}
+
+bool Compressor::Refines() const
+{
+  return refineThreshold > 0.0f && HasErrorKernel();
+}
+
+void Compressor::SetMeasureError(bool measure)
+{
+  measureError = measure && HasErrorKernel();
+}
+
+float Compressor::Rmse() const
+{
+  std::lock_guard<std::mutex> lock(errorMutex);
+  return errorValues > 0.0 ? (float)sqrt(errorSum / errorValues) : 0.0f;
+}
+
+int Compressor::PickSpeed(const rgba_surface & level, float target, std::vector<float> & rmse)
+{
+  const unsigned int maxSamples = 1024;
+  unsigned int blocksWidth = level.width / 4;
+  unsigned int blockCount = blocksWidth * (level.height / 4);
+  unsigned int samples = std::min(maxSamples, blockCount);
+
+  /* Blocks spread evenly over the level, grouped the way CompressClassified
+     would. Transparent blocks use the ultrafast profile at every speed. */
+  std::vector<unsigned int> classBlocks[BlockClassCount];
+  for (unsigned int i = 0; i < samples; i++) {
+    unsigned int block = (unsigned int)((uint64_t)i * blockCount / samples);
+    const uint8_t * texels = level.ptr + (block / blocksWidth) * 4 * level.stride + (block % blocksWidth) * 16;
+    classBlocks[hdr ? AlphaBlock : Classify(texels, level.stride)].push_back(block);
+  }
+
+  std::vector<uint8_t> texels;
+  std::vector<uint8_t> compressed;
+  std::vector<float> errors;
+
+  /* BC6H has no ultrafast profile and BC7 none slower than slow */
+  int fastest = hdr ? 4 : 5;
+  int slowest = hdr ? 0 : 1;
+  rmse.assign(6, -1.0f);
+
+  int speed;
+  for (speed = fastest; speed > slowest; speed--) {
+    Profile candidate;
+    GetProfile(speed, candidate);
+
+    double error = 0.0;
+    double values = 0.0;
+    for (int c = 0; c < TransparentBlock; c++) {
+      if (classBlocks[c].empty()) {
+        continue;
+      }
+
+      rgba_surface packed = GatherBlocks(level, classBlocks[c], 4, 4, BlockKeySize() / 4, texels);
+      compressed.resize(classBlocks[c].size() * blockSize);
+      errors.resize(classBlocks[c].size());
+      EncodeProfile(packed, compressed.data(), candidate, (BlockClass)c, errors.data());
+
+      for (float blockError : errors) {
+        error += blockError;
+      }
+      values += classBlocks[c].size() * 16 * (hdr ? 3 : candidate.bc7[c].channels);
+    }
+
+    float scale = hdr ? 64.0f / 31 : 1.0f;
+    rmse[speed] = values > 0.0 ? (float)sqrt(error / values) / scale : 0.0f;
+    if (rmse[speed] <= target) {
+      break;
+    }
+  }
+
+  GetProfile(speed, profile);
+  return speed;
+}
+
+void Compressor::CompressStrip(const rgba_surface & level, unsigned int firstBlockRow, unsigned int blockRows, uint8_t * dst, BlockCache * cache) const
+{
+  auto start = std::chrono::steady_clock::now();
+
+  rgba_surface surface;
+  surface.ptr = level.ptr + firstBlockRow * blockHeight * level.stride;
+  surface.width = level.width;
+  surface.height = blockRows * blockHeight;
+  surface.stride = level.stride;
+
+  /* BC4/BC5 and EAC R11/RG11 take R8/RG8, so those are repacked strip by
+     strip into a per-thread buffer. Everything else, including the half
+     float levels for BC6H, is compressed straight from the level. */
+  thread_local std::vector<uint8_t> scratch;
+
+  if (copyChannels != 4) {
+    scratch.resize(surface.width * surface.height * copyChannels);
+
+    for (int y = 0; y < surface.height; y++) {
+      const uint8_t * row = surface.ptr + y * surface.stride;
+      for (int x = 0; x < surface.width; x++) {
+        for (int channel = 0; channel < copyChannels; channel++) {
+          scratch[(y * surface.width + x) * copyChannels + channel] = row[x * 4 + channel];
+        }
+      }
+    }
+
+    surface.ptr = scratch.data();
+    surface.stride = surface.width * copyChannels;
+  }
+
+  if (cache != nullptr) {
+    CompressUnique(surface, dst, *cache);
+  } else {
+    CompressBlocks(surface, dst);
+  }
+
+  nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Compressor::CompressUnique(const rgba_surface & surface, uint8_t * dst, BlockCache & cache) const
+{
+  size_t keySize = cache.KeySize();
+  size_t rowSize = keySize / blockHeight;
+  unsigned int blocksWidth = surface.width / blockWidth;
+  unsigned int blockCount = blocksWidth * (surface.height / blockHeight);
+
+  /* Only the blocks that aren't in the cache are compressed */
+  thread_local std::vector<uint8_t> keys;
+  thread_local std::vector<uint64_t> hashes;
+  thread_local std::vector<int> uniqueIndex;
+  thread_local std::vector<unsigned int> uniqueBlocks;
+  thread_local std::vector<uint8_t> uniqueTexels;
+  thread_local std::vector<uint8_t> uniqueCompressed;
+  thread_local std::unordered_map<uint64_t, unsigned int> pending;
+
+  keys.resize(blockCount * keySize);
+  hashes.resize(blockCount);
+  uniqueIndex.assign(blockCount, -1);
+  uniqueBlocks.clear();
+  pending.clear();
+
+  size_t duplicates = 0;
+  for (unsigned int block = 0; block < blockCount; block++) {
+    uint8_t * key = keys.data() + block * keySize;
+    const uint8_t * texels = surface.ptr + (block / blocksWidth) * blockHeight * surface.stride + (block % blocksWidth) * rowSize;
+    for (int y = 0; y < blockHeight; y++) {
+      memcpy(key + y * rowSize, texels + y * surface.stride, rowSize);
+    }
+
+    hashes[block] = BlockCache::Hash(key, keySize);
+    if (cache.Find(hashes[block], key, dst + block * blockSize)) {
+      duplicates++;
+      continue;
+    }
+
+    /* Repeats within the strip are compressed once too */
+    auto found = pending.find(hashes[block]);
+    if (found != pending.end() && memcmp(keys.data() + uniqueBlocks[found->second] * keySize, key, keySize) == 0) {
+      uniqueIndex[block] = found->second;
+      duplicates++;
+      continue;
+    }
+
+    uniqueIndex[block] = (int)uniqueBlocks.size();
+    pending.emplace(hashes[block], (unsigned int)uniqueBlocks.size());
+    uniqueBlocks.push_back(block);
+  }
+
+  cache.AddStats(blockCount, duplicates);
+  if (uniqueBlocks.empty()) {
+    return;
+  }
+
+  rgba_surface unique = GatherBlocks(surface, uniqueBlocks, blockWidth, blockHeight, rowSize, uniqueTexels);
+  uniqueCompressed.resize(uniqueBlocks.size() * blockSize);
+  CompressBlocks(unique, uniqueCompressed.data());
+
+  for (unsigned int block = 0; block < blockCount; block++) {
+    if (uniqueIndex[block] >= 0) {
+      memcpy(dst + block * blockSize, uniqueCompressed.data() + uniqueIndex[block] * blockSize, blockSize);
+    }
+  }
+
+  for (size_t i = 0; i < uniqueBlocks.size(); i++) {
+    cache.Insert(hashes[uniqueBlocks[i]], keys.data() + uniqueBlocks[i] * keySize, uniqueCompressed.data() + i * blockSize);
+  }
+}
+
+Compressor::BlockClass Compressor::Classify(const uint8_t * texels, int stride)
+{
+  bool opaque = true;
+  bool transparent = true;
+  bool grey = true;
+
+  for (int y = 0; y < 4; y++) {
+    for (int x = 0; x < 4; x++) {
+      const uint8_t * texel = texels + y * stride + x * 4;
+      opaque = opaque && texel[3] == 255;
+      transparent = transparent && texel[3] == 0;
+      grey = grey && texel[0] == texel[1] && texel[1] == texel[2];
+    }
+  }
+
+  if (transparent) {
+    return TransparentBlock;
+  } else if (opaque) {
+    return grey ? OpaqueGreyBlock : OpaqueBlock;
+  }
+  return grey ? AlphaGreyBlock : AlphaBlock;
+}
+
+Compressor::BlockClass Compressor::ClassifyOpacity(const uint8_t * texels, int stride) const
+{
+  for (int y = 0; y < blockHeight; y++) {
+    for (int x = 0; x < blockWidth; x++) {
+      if (texels[y * stride + x * 4 + 3] != 255) {
+        return AlphaBlock;
+      }
+    }
+  }
+  return OpaqueBlock;
+}
+
+void Compressor::CompressBlocks(const rgba_surface & surface, uint8_t * dst) const
+{
+  if (format == "BC7" || format == "BC7_SRGB" || format.substr(0, 5) == "ASTC_") {
+    CompressClassified(surface, dst);
+  } else {
+    Encode(surface, dst, AlphaBlock);
+  }
+}
+
+void Compressor::CompressClassified(const rgba_surface & surface, uint8_t * dst) const
+{
+  unsigned int blocksWidth = surface.width / blockWidth;
+  unsigned int blockCount = blocksWidth * (surface.height / blockHeight);
+  bool astc = format.substr(0, 5) == "ASTC_";
+
+  thread_local std::vector<unsigned int> classBlocks[BlockClassCount];
+  thread_local std::vector<uint8_t> classTexels;
+  thread_local std::vector<uint8_t> classCompressed;
+
+  for (int c = 0; c < BlockClassCount; c++) {
+    classBlocks[c].clear();
+  }
+
+  for (unsigned int block = 0; block < blockCount; block++) {
+    const uint8_t * texels = surface.ptr + (block / blocksWidth) * blockHeight * surface.stride + (block % blocksWidth) * blockWidth * 4;
+    classBlocks[astc ? ClassifyOpacity(texels, surface.stride) : Classify(texels, surface.stride)].push_back(block);
+  }
+
+  /* Usually the whole strip is one class and can go straight through */
+  for (int c = 0; c < BlockClassCount; c++) {
+    if (classBlocks[c].size() == blockCount) {
+      Encode(surface, dst, (BlockClass)c);
+      return;
+    }
+  }
+
+  for (int c = 0; c < BlockClassCount; c++) {
+    if (classBlocks[c].empty()) {
+      continue;
+    }
+
+    rgba_surface packed = GatherBlocks(surface, classBlocks[c], blockWidth, blockHeight, blockWidth * 4, classTexels);
+    classCompressed.resize(classBlocks[c].size() * blockSize);
+    Encode(packed, classCompressed.data(), (BlockClass)c);
+    ScatterBlocks(classCompressed.data(), classBlocks[c], blockSize, dst);
+  }
+}
+
+void Compressor::Encode(const rgba_surface & surface, uint8_t * dst, BlockClass blockClass) const
+{
+  if (!Refines() && !measureError) {
+    EncodeProfile(surface, dst, profile, blockClass, nullptr);
+    return;
+  }
+
+  unsigned int blockCount = (surface.width / 4) * (surface.height / 4);
+
+  thread_local std::vector<float> errors;
+  thread_local std::vector<float> refinedErrors;
+  thread_local std::vector<unsigned int> refineBlocks;
+  thread_local std::vector<uint8_t> refineTexels;
+  thread_local std::vector<uint8_t> refineCompressed;
+
+  errors.resize(blockCount);
+  EncodeProfile(surface, dst, profile, blockClass, errors.data());
+
+  /* The kernels report summed squared errors, in half float bit patterns
+     scaled by 64/31 for BC6H */
+  int channels = hdr ? 3 : profile.bc7[blockClass].channels;
+  float scale = hdr ? 64.0f / 31 : 1.0f;
+  float threshold = refineThreshold * refineThreshold * scale * scale * 16 * channels;
+
+  refineBlocks.clear();
+  if (Refines()) {
+    for (unsigned int block = 0; block < blockCount; block++) {
+      if (errors[block] > threshold) {
+        refineBlocks.push_back(block);
+      }
+    }
+  }
+
+  if (!refineBlocks.empty()) {
+    rgba_surface packed = GatherBlocks(surface, refineBlocks, 4, 4, BlockKeySize() / 4, refineTexels);
+    refineCompressed.resize(refineBlocks.size() * blockSize);
+    refinedErrors.resize(refineBlocks.size());
+    EncodeProfile(packed, refineCompressed.data(), refineProfile, blockClass, refinedErrors.data());
+
+    for (size_t i = 0; i < refineBlocks.size(); i++) {
+      if (refinedErrors[i] < errors[refineBlocks[i]]) {
+        memcpy(dst + refineBlocks[i] * blockSize, refineCompressed.data() + i * blockSize, blockSize);
+        errors[refineBlocks[i]] = refinedErrors[i];
+      }
+    }
+    refinedBlocks += refineBlocks.size();
+  }
+
+  if (measureError) {
+    double sum = 0.0;
+    for (unsigned int block = 0; block < blockCount; block++) {
+      sum += errors[block];
+    }
+
+    std::lock_guard<std::mutex> lock(errorMutex);
+    errorSum += sum / (scale * scale);
+    errorValues += blockCount * 16 * channels;
+  }
+}
+
+void Compressor::EncodeProfile(const rgba_surface & surface, uint8_t * dst, const Profile & profile, BlockClass blockClass, float * errors) const
+{
+  if (format == "BC6H" && errors != nullptr) {
+    CompressBlocksBC6HError(&surface, dst, (bc6h_enc_settings *)&profile.bc6h, errors);
+  } else if (format == "BC6H") {
+    CompressBlocksBC6H(&surface, dst, (bc6h_enc_settings *)&profile.bc6h);
+  } else if (format == "BC1" || format == "BC1_SRGB") {
+    CompressBlocksBC1(&surface, dst);
+  } else if (format == "BC3" || format == "BC3_SRGB") {
+    CompressBlocksBC3(&surface, dst);
+  } else if (format == "BC4") {
+    CompressBlocksBC4(&surface, dst);
+  } else if (format == "BC5") {
+    CompressBlocksBC5(&surface, dst);
+  } else if ((format == "BC7" || format == "BC7_SRGB") && errors != nullptr) {
+    CompressBlocksBC7Error(&surface, dst, (bc7_enc_settings *)&profile.bc7[blockClass], errors);
+  } else if (format == "BC7" || format == "BC7_SRGB") {
+    CompressBlocksBC7(&surface, dst, (bc7_enc_settings *)&profile.bc7[blockClass]);
+  } else if (format == "ETC1" || format == "ETC1_SRGB") {
+    CompressBlocksETC1(&surface, dst, (etc_enc_settings *)&profile.etc);
+  } else if (format == "ETC2" || format == "ETC2_SRGB") {
+    CompressBlocksETC2(&surface, dst, (etc_enc_settings *)&profile.etc);
+  } else if (format == "ETC2_RGBA" || format == "ETC2_RGBA_SRGB") {
+    CompressBlocksETC2RGBA(&surface, dst, (etc_enc_settings *)&profile.etc);
+  } else if (format == "EAC_R11") {
+    CompressBlocksEACR11(&surface, dst);
+  } else if (format == "EAC_RG11") {
+    CompressBlocksEACRG11(&surface, dst);
+  } else if (format.substr(0, 5) == "ASTC_") {
+    CompressBlocksASTC(&surface, dst, (astc_enc_settings *)&profile.astc[blockClass]);
+  }
+}
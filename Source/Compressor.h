@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ispc_texcomp/ispc_texcomp.h"
+#include "BlockCache.h"
+
+/* Fills the padding of a level whose rows have been rounded up to whole
+   blocks, by replicating the last row/column into the edge blocks. */
+void PadToBlocks(const rgba_surface & level, int width, int height, int bpp, int blockWidth = 4, int blockHeight = 4);
+
+class Compressor
+{
+public:
+  Compressor(const std::string & format, size_t blockSize, int speed);
+
+  size_t BlockSize() const { return blockSize; }
+  bool Hdr() const { return hdr; }
+
+  /* Footprint of a block in texels, 4x4 for everything but ASTC, whose
+     formats are named ASTC_<width>x<height> */
+  static void BlockDimensions(const std::string & format, int & width, int & height);
+  int BlockWidth() const { return blockWidth; }
+  int BlockHeight() const { return blockHeight; }
+
+  /* Size of the texels the encoder sees for one block, the key size for a
+     BlockCache. */
+  size_t BlockKeySize() const { return blockWidth * blockHeight * copyChannels * (hdr ? sizeof(uint16_t) : 1); }
+
+  /* Compresses blockRows rows of blocks, starting at firstBlockRow, from a
+     padded level surface (RGBA8, or RGBA16F for BC6H) into dst. With a cache,
+     only blocks it hasn't seen are compressed. */
+  void CompressStrip(const rgba_surface & level, unsigned int firstBlockRow, unsigned int blockRows, uint8_t * dst, BlockCache * cache = nullptr) const;
+
+  /* Adaptive encoding for BC6H and BC7: blocks are encoded with the profile
+     given to the constructor first, and those whose RMS error is above
+     threshold (8 bit steps, or half float steps for BC6H) are encoded again
+     with speed's profile, keeping the better of the two. */
+  void SetRefinement(int speed, float threshold);
+  bool Refines() const;
+  size_t RefinedBlocks() const { return refinedBlocks; }
+
+  /* Encodes a sample of a level's blocks with each profile from ultrafast (5)
+     down to veryslow (0), and switches to the fastest whose RMS error is
+     within target, or the slowest. rmse[speed] is set for each speed tried
+     and left negative for the others. BC6H and BC7 only. */
+  int PickSpeed(const rgba_surface & level, float target, std::vector<float> & rmse);
+
+  /* Time spent in CompressStrip, summed over every thread that called it */
+  double Seconds() const { return nanoseconds * 1e-9; }
+
+  /* Once enabled, the error of every block encoded is kept, and Rmse()
+     returns the RMS error so far in 8 bit steps, or half float steps for
+     BC6H. Blocks copied from a BlockCache aren't counted. BC6H and BC7 only. */
+  void SetMeasureError(bool measure);
+  float Rmse() const;
+
+private:
+  /* BC7 blocks are classified before compression and each class gets its own
+     profile. Opaque blocks don't need the alpha search, fully transparent ones
+     get the cheapest alpha profile, and in greyscale blocks rotating one
+     colour channel into the scalar channel finds nothing the other colour
+     rotations don't. */
+  enum BlockClass
+  {
+    OpaqueBlock,
+    OpaqueGreyBlock,
+    AlphaBlock,
+    AlphaGreyBlock,
+    TransparentBlock,
+    BlockClassCount
+  };
+
+  static BlockClass Classify(const uint8_t * texels, int stride);
+
+  /* ASTC blocks are only split into opaque and alpha blocks */
+  BlockClass ClassifyOpacity(const uint8_t * texels, int stride) const;
+  bool HasErrorKernel() const { return format == "BC6H" || format == "BC7" || format == "BC7_SRGB"; }
+
+  void CompressBlocks(const rgba_surface & surface, uint8_t * dst) const;
+  void CompressClassified(const rgba_surface & surface, uint8_t * dst) const;
+  void CompressUnique(const rgba_surface & surface, uint8_t * dst, BlockCache & cache) const;
+  void Encode(const rgba_surface & surface, uint8_t * dst, BlockClass blockClass) const;
+
+  struct Profile
+  {
+    bc6h_enc_settings bc6h;
+    bc7_enc_settings bc7[BlockClassCount];
+    etc_enc_settings etc;
+    astc_enc_settings astc[BlockClassCount];
+  };
+
+  void GetProfile(int speed, Profile & profile) const;
+  void EncodeProfile(const rgba_surface & surface, uint8_t * dst, const Profile & profile, BlockClass blockClass, float * errors) const;
+
+  std::string format;
+  size_t blockSize;
+  int blockWidth;
+  int blockHeight;
+  int copyChannels;
+  bool hdr;
+
+  Profile profile;
+  Profile refineProfile;
+  float refineThreshold;
+  mutable std::atomic<size_t> refinedBlocks;
+  mutable std::atomic<uint64_t> nanoseconds;
+
+  bool measureError;
+  mutable std::mutex errorMutex;
+  mutable double errorSum;
+  mutable double errorValues;
+};
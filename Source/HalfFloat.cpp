@@ -1036,4 +1036,30 @@ namespace HalfFloat {
     uint32_t f = *reinterpret_cast<uint32_t *>(&x);
     return basetable[(f >> 23) & 0x1ff] + ((f & 0x007fffff) >> shifttable[(f >> 23) & 0x1ff]);
   }
+
+  float ToFloat(uint16_t h)
+  {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t f;
+
+    if (exponent == 0x1f) {
+      f = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+      f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa != 0) {
+      /* Denormal, renormalise it */
+      exponent = 113;
+      while ((mantissa & 0x400) == 0) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    } else {
+      f = sign;
+    }
+
+    return *reinterpret_cast<float *>(&f);
+  }
 }
@@ -5,4 +5,5 @@
 namespace HalfFloat
 {
   uint16_t FromFloat(float x);
+  float ToFloat(uint16_t h);
 };
\ No newline at end of file
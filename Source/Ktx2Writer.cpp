@@ -0,0 +1,294 @@
+#include "Ktx2Writer.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+#include <zstd.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const uint8_t identifier[] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+static const uint32_t headerSize = 80;
+static const uint32_t levelIndexEntrySize = 24;
+static const uint32_t supercompressionZstd = 2;
+
+Ktx2Writer::Ktx2Writer(VkFormat format, size_t blockSize, uint32_t width, uint32_t height, uint32_t layerCount, uint32_t faceCount, const std::vector<size_t> & imageSizes, int zstdLevel) :
+  format(format),
+  blockSize(blockSize),
+  width(width),
+  height(height),
+  layerCount(layerCount),
+  faceCount(faceCount),
+  imageCount(std::max(layerCount, 1u) * faceCount),
+  zstdLevel(zstdLevel),
+  imageSizes(imageSizes),
+  levelOffsets(imageSizes.size()),
+  levelLengths(imageSizes.size()),
+  data(nullptr),
+  size(0),
+#if defined(_WIN32)
+  file(INVALID_HANDLE_VALUE),
+  mapping(nullptr)
+#else
+  file(-1)
+#endif
+{
+  dfd = vk2dfd(format);
+
+  for (size_t level = 0; level < imageSizes.size(); level++) {
+    levelLengths[level] = imageSizes[level] * imageCount;
+  }
+}
+
+Ktx2Writer::~Ktx2Writer()
+{
+  Unmap();
+  free(dfd);
+}
+
+void Ktx2Writer::Layout()
+{
+  /* Levels are stored smallest first, each aligned to the block size.
+     Supercompressed levels have no alignment. */
+  uint64_t alignment = zstdLevel != 0 ? 1 : std::lcm((size_t)4, blockSize);
+  uint64_t offset = headerSize + levelIndexEntrySize * imageSizes.size() + dfd[0];
+  for (int level = (int)imageSizes.size() - 1; level >= 0; level--) {
+    offset = (offset + alignment - 1) / alignment * alignment;
+    levelOffsets[level] = offset;
+    offset += levelLengths[level];
+  }
+  size = offset;
+}
+
+bool Ktx2Writer::Map()
+{
+#if defined(_WIN32)
+  file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), nullptr);
+  if (mapping == nullptr) {
+    return false;
+  }
+
+  data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+  if (data == nullptr) {
+    return false;
+  }
+#else
+  file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (file < 0) {
+    return false;
+  }
+
+  /* Reserve the blocks rather than leaving the file sparse, a full disk
+     would otherwise only show up as a SIGBUS when the mapping is written */
+  if (posix_fallocate(file, 0, (off_t)size) != 0) {
+    return false;
+  }
+
+  void * mapped = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  data = (uint8_t *)mapped;
+#endif
+
+  return true;
+}
+
+void Ktx2Writer::WriteHeader()
+{
+  uint32_t levelCount = imageSizes.size();
+  uint32_t typeSize = 1; // Fix for uncompressed vkformats, size of an individual component
+  uint32_t pixelDepth = 0;
+  uint32_t supercompressionScheme = zstdLevel != 0 ? supercompressionZstd : 0;
+  uint32_t dfdByteOffset = headerSize + levelIndexEntrySize * levelCount;
+  uint32_t dfdByteLength = dfd[0];
+  uint32_t kvdByteOffset = 0;
+  uint32_t kvdByteLength = 0;
+  uint64_t sgdByteOffset = 0;
+  uint64_t sgdByteLength = 0;
+
+  uint8_t * p = data;
+  auto put = [&](const void * value, size_t length) {
+    memcpy(p, value, length);
+    p += length;
+  };
+
+  put(identifier, sizeof(identifier));
+  put(&format, sizeof(uint32_t));
+  put(&typeSize, sizeof(typeSize));
+  put(&width, sizeof(width));
+  put(&height, sizeof(height));
+  put(&pixelDepth, sizeof(pixelDepth));
+  put(&layerCount, sizeof(layerCount));
+  put(&faceCount, sizeof(faceCount));
+  put(&levelCount, sizeof(levelCount));
+  put(&supercompressionScheme, sizeof(supercompressionScheme));
+
+  put(&dfdByteOffset, sizeof(dfdByteOffset));
+  put(&dfdByteLength, sizeof(dfdByteLength));
+  put(&kvdByteOffset, sizeof(kvdByteOffset));
+  put(&kvdByteLength, sizeof(kvdByteLength));
+  put(&sgdByteOffset, sizeof(sgdByteOffset));
+  put(&sgdByteLength, sizeof(sgdByteLength));
+
+  for (uint32_t level = 0; level < levelCount; level++) {
+    uint64_t byteOffset = levelOffsets[level];
+    uint64_t byteLength = levelLengths[level];
+    uint64_t uncompressedByteLength = imageSizes[level] * imageCount;
+    put(&byteOffset, sizeof(byteOffset));
+    put(&byteLength, sizeof(byteLength));
+    put(&uncompressedByteLength, sizeof(uncompressedByteLength));
+  }
+
+  put(dfd, dfdByteLength);
+
+  /* The file is created zero filled, so the alignment padding is already there */
+}
+
+bool Ktx2Writer::Unmap()
+{
+  bool ok = true;
+
+#if defined(_WIN32)
+  if (data != nullptr) {
+    UnmapViewOfFile(data);
+    data = nullptr;
+  }
+  if (mapping != nullptr) {
+    CloseHandle(mapping);
+    mapping = nullptr;
+  }
+  if (file != INVALID_HANDLE_VALUE) {
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (data != nullptr) {
+    munmap(data, (size_t)size);
+    data = nullptr;
+  }
+  if (file >= 0) {
+    ok = close(file) == 0;
+    file = -1;
+  }
+#endif
+
+  return ok;
+}
+
+bool Ktx2Writer::Open(const std::string & path)
+{
+  this->path = path;
+
+  if (zstdLevel != 0) {
+    staging.resize(imageSizes.size());
+    frames.resize(imageSizes.size());
+    for (size_t level = 0; level < imageSizes.size(); level++) {
+      staging[level].resize(imageCount);
+      frames[level].resize(imageCount);
+      for (auto & image : staging[level]) {
+        image.resize(imageSizes[level]);
+      }
+    }
+    return true;
+  }
+
+  Layout();
+  if (!Map()) {
+    return false;
+  }
+
+  WriteHeader();
+  return true;
+}
+
+uint8_t * Ktx2Writer::Image(uint32_t level, uint32_t image)
+{
+  if (zstdLevel != 0) {
+    return staging[level][image].data();
+  }
+
+  return data + levelOffsets[level] + imageSizes[level] * image;
+}
+
+bool Ktx2Writer::FinishImage(uint32_t level, uint32_t image)
+{
+  if (zstdLevel == 0) {
+    return true;
+  }
+
+  /* Compression contexts are large at the higher levels, keep one per thread */
+  thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+
+  std::vector<uint8_t> & source = staging[level][image];
+  std::vector<uint8_t> & frame = frames[level][image];
+  frame.resize(ZSTD_compressBound(source.size()));
+  size_t compressedSize = ZSTD_compressCCtx(context.get(), frame.data(), frame.size(), source.data(), source.size(), zstdLevel);
+  if (ZSTD_isError(compressedSize)) {
+    return false;
+  }
+  frame.resize(compressedSize);
+  frame.shrink_to_fit();
+
+  std::vector<uint8_t>().swap(source);
+  return true;
+}
+
+bool Ktx2Writer::Close()
+{
+  bool ok = true;
+
+  /* Supercompressed levels are the concatenation of their images' frames,
+     which decompresses as a single stream. */
+  if (zstdLevel != 0 && !path.empty()) {
+    for (size_t level = 0; level < imageSizes.size(); level++) {
+      levelLengths[level] = 0;
+      for (auto & frame : frames[level]) {
+        levelLengths[level] += frame.size();
+      }
+    }
+
+    Layout();
+    ok = Map();
+    if (ok) {
+      WriteHeader();
+      for (size_t level = 0; level < imageSizes.size(); level++) {
+        uint8_t * p = data + levelOffsets[level];
+        for (auto & frame : frames[level]) {
+          memcpy(p, frame.data(), frame.size());
+          p += frame.size();
+        }
+      }
+    }
+
+    frames.clear();
+    staging.clear();
+  }
+  path.clear();
+
+  /* Write back errors are only reported by an explicit flush */
+#if defined(_WIN32)
+  if (data != nullptr && !FlushViewOfFile(data, 0)) {
+    ok = false;
+  }
+#else
+  if (data != nullptr && msync(data, (size_t)size, MS_SYNC) != 0) {
+    ok = false;
+  }
+#endif
+
+  return Unmap() && ok;
+}
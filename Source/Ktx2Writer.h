@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "dfd.h"
+
+/* Writes a KTX2 file in one pass. The whole layout (header, level index, DFD
+   and aligned level data) is known up front, so the file is sized once and
+   memory mapped, and the compressors write each image straight to its final
+   offset.
+
+   With Zstandard supercompression the level sizes aren't known until the end,
+   so images are staged in memory, compressed one frame per face/layer as they
+   complete, and the file is written by Close. */
+class Ktx2Writer
+{
+public:
+  /* imageSizes holds the size in bytes of one face/layer of each level. A
+     zstdLevel of 0 disables supercompression. */
+  Ktx2Writer(VkFormat format, size_t blockSize, uint32_t width, uint32_t height, uint32_t layerCount, uint32_t faceCount, const std::vector<size_t> & imageSizes, int zstdLevel = 0);
+  ~Ktx2Writer();
+
+  Ktx2Writer(const Ktx2Writer &) = delete;
+  Ktx2Writer & operator=(const Ktx2Writer &) = delete;
+
+  /* Creates and maps the output file and writes everything but the level
+     data. With supercompression the staging buffers are allocated instead. */
+  bool Open(const std::string & path);
+
+  /* Where a face/layer of a level is to be written, images are numbered
+     layer major, face minor. */
+  uint8_t * Image(uint32_t level, uint32_t image);
+
+  /* Called once an image is complete. With supercompression it is
+     compressed into its own Zstandard frame and the staging buffer freed,
+     images can be compressed on any thread. */
+  bool FinishImage(uint32_t level, uint32_t image);
+
+  /* Writes the file if it was staged, and flushes and unmaps it, leaving it
+     complete on disk. Returns false if any of the data couldn't be written. */
+  bool Close();
+
+private:
+  void Layout();
+  bool Map();
+  void WriteHeader();
+  bool Unmap();
+
+  VkFormat format;
+  size_t blockSize;
+  uint32_t width;
+  uint32_t height;
+  uint32_t layerCount;
+  uint32_t faceCount;
+  uint32_t imageCount;
+  int zstdLevel;
+  std::vector<size_t> imageSizes;
+  std::vector<uint64_t> levelOffsets;
+  std::vector<uint64_t> levelLengths;
+  uint32_t * dfd;
+  std::string path;
+
+  /* [level][image] uncompressed images and their Zstandard frames */
+  std::vector<std::vector<std::vector<uint8_t>>> staging;
+  std::vector<std::vector<std::vector<uint8_t>>> frames;
+
+  uint8_t * data;
+  uint64_t size;
+#if defined(_WIN32)
+  void * file;
+  void * mapping;
+#else
+  int file;
+#endif
+};
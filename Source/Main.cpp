@@ -5,17 +5,29 @@
 #include <algorithm>
 #include <vulkan/vulkan.hpp>
 #include <math.h>
-#include <thread>
-#include <mutex>
 #include <numeric>
-#include <fstream>
+#include <cstdio>
 #include <iomanip>
 #include <vector>
-#include "stb_image_resize.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <zstd.h>
 #include "stb_image.h"
 #include "dfd.h"
 #include "ispc_texcomp/ispc_texcomp.h"
+#include "Compressor.h"
 #include "HalfFloat.h"
+#include "ThreadPool.h"
+#include "Progress.h"
+#include "Mipmap.h"
+#include "Ktx2Writer.h"
+#include "MipArena.h"
+#include "BandReader.h"
+#include "Streaming.h"
+#include "Calibration.h"
+#include "BlockCache.h"
+#include "TailPacker.h"
 
 const std::vector<std::string> formatOrder = {
   "BC1",
@@ -26,7 +38,43 @@ const std::vector<std::string> formatOrder = {
   "BC3_SRGB",
   "BC6H",
   "BC7",
-  "BC7_SRGB"
+  "BC7_SRGB",
+  "ETC1",
+  "ETC1_SRGB",
+  "ETC2",
+  "ETC2_SRGB",
+  "ETC2_RGBA",
+  "ETC2_RGBA_SRGB",
+  "EAC_R11",
+  "EAC_RG11",
+  "ASTC_4x4",
+  "ASTC_4x4_SRGB",
+  "ASTC_5x4",
+  "ASTC_5x4_SRGB",
+  "ASTC_5x5",
+  "ASTC_5x5_SRGB",
+  "ASTC_6x5",
+  "ASTC_6x5_SRGB",
+  "ASTC_6x6",
+  "ASTC_6x6_SRGB",
+  "ASTC_8x5",
+  "ASTC_8x5_SRGB",
+  "ASTC_8x6",
+  "ASTC_8x6_SRGB",
+  "ASTC_8x8",
+  "ASTC_8x8_SRGB",
+  "ASTC_10x5",
+  "ASTC_10x5_SRGB",
+  "ASTC_10x6",
+  "ASTC_10x6_SRGB",
+  "ASTC_10x8",
+  "ASTC_10x8_SRGB",
+  "ASTC_10x10",
+  "ASTC_10x10_SRGB",
+  "ASTC_12x10",
+  "ASTC_12x10_SRGB",
+  "ASTC_12x12",
+  "ASTC_12x12_SRGB"
 };
 
 const std::map<std::string, std::tuple<std::string, int, vk::Format>> formats = {
@@ -38,15 +86,114 @@ const std::map<std::string, std::tuple<std::string, int, vk::Format>> formats =
   {"BC3_SRGB", {"(DXT5) BC1 Color, BC4 Alpha, 16 bytes per block.", 16, vk::Format::eBc3SrgbBlock}},
   {"BC6H", {"16 bit RGB, no alpha. Signed. 16 bytes per block.", 16, vk::Format::eBc6HUfloatBlock}},
   {"BC7", {"8 bit RGBA - Good general purpose. 16 bytes per block.", 16, vk::Format::eBc7UnormBlock}},
-  {"BC7_SRGB", {"8 bit RGBA - Good general purpose. 16 bytes per block.", 16, vk::Format::eBc7SrgbBlock}}
+  {"BC7_SRGB", {"8 bit RGBA - Good general purpose. 16 bytes per block.", 16, vk::Format::eBc7SrgbBlock}},
+  {"ETC1", {"RGB, no alpha, stored as ETC2 RGB. 8 bytes per block.", 8, vk::Format::eEtc2R8G8B8UnormBlock}},
+  {"ETC1_SRGB", {"RGB, no alpha, stored as ETC2 RGB. 8 bytes per block.", 8, vk::Format::eEtc2R8G8B8SrgbBlock}},
+  {"ETC2", {"RGB, no alpha. ETC1 plus the T, H and planar modes. 8 bytes per block.", 8, vk::Format::eEtc2R8G8B8UnormBlock}},
+  {"ETC2_SRGB", {"RGB, no alpha. ETC1 plus the T, H and planar modes. 8 bytes per block.", 8, vk::Format::eEtc2R8G8B8SrgbBlock}},
+  {"ETC2_RGBA", {"ETC2 Color, EAC Alpha. 16 bytes per block.", 16, vk::Format::eEtc2R8G8B8A8UnormBlock}},
+  {"ETC2_RGBA_SRGB", {"ETC2 Color, EAC Alpha. 16 bytes per block.", 16, vk::Format::eEtc2R8G8B8A8SrgbBlock}},
+  {"EAC_R11", {"Greyscale, 11 bit. 8 bytes per block.", 8, vk::Format::eEacR11UnormBlock}},
+  {"EAC_RG11", {"2x EAC R11 images. 16 bytes per block.", 16, vk::Format::eEacR11G11UnormBlock}},
+  {"ASTC_4x4", {"4x4 RGBA, 8.00 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc4x4UnormBlock}},
+  {"ASTC_4x4_SRGB", {"4x4 RGBA, 8.00 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc4x4SrgbBlock}},
+  {"ASTC_5x4", {"5x4 RGBA, 6.40 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc5x4UnormBlock}},
+  {"ASTC_5x4_SRGB", {"5x4 RGBA, 6.40 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc5x4SrgbBlock}},
+  {"ASTC_5x5", {"5x5 RGBA, 5.12 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc5x5UnormBlock}},
+  {"ASTC_5x5_SRGB", {"5x5 RGBA, 5.12 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc5x5SrgbBlock}},
+  {"ASTC_6x5", {"6x5 RGBA, 4.27 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc6x5UnormBlock}},
+  {"ASTC_6x5_SRGB", {"6x5 RGBA, 4.27 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc6x5SrgbBlock}},
+  {"ASTC_6x6", {"6x6 RGBA, 3.56 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc6x6UnormBlock}},
+  {"ASTC_6x6_SRGB", {"6x6 RGBA, 3.56 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc6x6SrgbBlock}},
+  {"ASTC_8x5", {"8x5 RGBA, 3.20 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc8x5UnormBlock}},
+  {"ASTC_8x5_SRGB", {"8x5 RGBA, 3.20 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc8x5SrgbBlock}},
+  {"ASTC_8x6", {"8x6 RGBA, 2.67 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc8x6UnormBlock}},
+  {"ASTC_8x6_SRGB", {"8x6 RGBA, 2.67 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc8x6SrgbBlock}},
+  {"ASTC_8x8", {"8x8 RGBA, 2.00 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc8x8UnormBlock}},
+  {"ASTC_8x8_SRGB", {"8x8 RGBA, 2.00 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc8x8SrgbBlock}},
+  {"ASTC_10x5", {"10x5 RGBA, 2.56 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x5UnormBlock}},
+  {"ASTC_10x5_SRGB", {"10x5 RGBA, 2.56 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x5SrgbBlock}},
+  {"ASTC_10x6", {"10x6 RGBA, 2.13 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x6UnormBlock}},
+  {"ASTC_10x6_SRGB", {"10x6 RGBA, 2.13 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x6SrgbBlock}},
+  {"ASTC_10x8", {"10x8 RGBA, 1.60 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x8UnormBlock}},
+  {"ASTC_10x8_SRGB", {"10x8 RGBA, 1.60 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x8SrgbBlock}},
+  {"ASTC_10x10", {"10x10 RGBA, 1.28 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x10UnormBlock}},
+  {"ASTC_10x10_SRGB", {"10x10 RGBA, 1.28 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc10x10SrgbBlock}},
+  {"ASTC_12x10", {"12x10 RGBA, 1.07 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc12x10UnormBlock}},
+  {"ASTC_12x10_SRGB", {"12x10 RGBA, 1.07 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc12x10SrgbBlock}},
+  {"ASTC_12x12", {"12x12 RGBA, 0.89 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc12x12UnormBlock}},
+  {"ASTC_12x12_SRGB", {"12x12 RGBA, 0.89 bits per pixel. 16 bytes per block.", 16, vk::Format::eAstc12x12SrgbBlock}}
 };
 
-const std::string usage = "[cube|array] <input> [input2, input3...] <output> <format> [fast|normal|slow|veryslow]";
+const std::vector<std::tuple<std::string, std::string, std::string>> optionOrder = {
+  {"--adaptive", "[=rmse]", "BC6H/BC7: encode fast, then redo blocks above the RMS error (default 2) at the given speed."},
+  {"--calibrate", "", "Time each kernel target per format and cache the fastest for this CPU."},
+  {"--dedup", "[=layers]", "Compress identical blocks in a level once, across every layer and face with =layers."},
+  {"--decode-threads", "=<n>", "Inputs decoded and held in memory at once, default min(threads, 4)."},
+  {"--isa", "=<sse4|avx2|avx512skx|avx512icl>", "Compression kernel target, default the best the CPU supports."},
+  {"--mip-filter", "=<box|triangle|kaiser|mitchell>", "Mip filter, default mitchell, or kaiser with --stream. Mitchell always uses stb_image_resize."},
+  {"--mip-speeds", "=<speed,...>", "BC6H/BC7: speed per mip level from level 0, the last repeating, e.g. fast,slow,slow,slow,veryslow."},
+  {"--no-progress", "", "Don't print the progress bar, for batch runs."},
+  {"--stream", "", "Stream inputs in bands of rows, for images too large for memory."},
+  {"--target-error", "=<rmse>", "BC6H/BC7: use the fastest profile that keeps a sample of the first input within the RMS error."},
+  {"--target-psnr", "=<dB>", "BC7: as --target-error, with the target given as PSNR."},
+  {"--zstd", "[=level]", "Zstandard supercompression, level 1-22, default 19."}
+};
+
+/* Indexed by speed, veryfast and ultrafast are only reachable through
+   --mip-speeds and the target error options */
+const std::vector<std::string> speedNames = {"veryslow", "slow", "normal", "fast", "veryfast", "ultrafast"};
+
+const std::string usage = "[options] [cube|array] <input> [input2, input3...] <output> <format> [fast|normal|slow|veryslow]";
 
 int main(int argc, char ** argv)
 {
   ISPCInit();
 
+  /* Pull --name[=value] options out, leaving the positional arguments in argv */
+  std::map<std::string, std::string> options;
+  std::vector<char *> positional;
+  for (int i = 0; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (i > 0 && arg.substr(0, 2) == "--") {
+      size_t equals = arg.find('=');
+      std::string name = arg.substr(0, equals);
+      auto known = std::find_if(optionOrder.begin(), optionOrder.end(), [&](auto & option){ return std::get<0>(option) == name; });
+      if (known == optionOrder.end()) {
+        std::cout << "Unknown option: " << name << std::endl;
+        return 1;
+      }
+      options[name] = equals == std::string::npos ? "" : arg.substr(equals + 1);
+    } else {
+      positional.push_back(argv[i]);
+    }
+  }
+  argc = (int)positional.size();
+  argv = positional.data();
+
+  std::string calibrationKey = CalibrationKey();
+  std::string calibrationPath = CalibrationPath();
+  if (options.count("--calibrate")) {
+    std::vector<std::pair<std::string, size_t>> calibrationFormats;
+    for (auto & formatName : formatOrder) {
+      if (formatName.find("_SRGB") == std::string::npos) {
+        calibrationFormats.push_back({formatName, std::get<1>(formats.at(formatName))});
+      }
+    }
+
+    std::cout << "Calibrating " << calibrationKey << std::endl;
+    std::map<std::string, int> calibration = Calibrate(calibrationFormats);
+    if (!SaveCalibration(calibrationPath, calibrationKey, calibration)) {
+      std::cout << "Failed to write calibration: " << calibrationPath << std::endl;
+      return 1;
+    }
+    std::cout << "Calibration saved to " << calibrationPath << std::endl;
+
+    if (argc == 1) {
+      return 0;
+    }
+  }
+
   if (argc < 4) {
     std::cout << "Usage: " << argv[0] << " " << usage << std::endl;
     std::cout << "Formats:" << std::endl;
@@ -54,6 +201,10 @@ int main(int argc, char ** argv)
       auto format = formats.at(formatName);
       std::cout << "  " << formatName << " - " << std::get<0>(format) << std::endl;
     }
+    std::cout << "Options:" << std::endl;
+    for (auto & option : optionOrder) {
+      std::cout << "  " << std::get<0>(option) << std::get<1>(option) << " - " << std::get<2>(option) << std::endl;
+    }
     return 1;
   }
 
@@ -127,6 +278,137 @@ int main(int argc, char ** argv)
     hdr = true;
   }
 
+  int blockWidth, blockHeight;
+  Compressor::BlockDimensions(formatString, blockWidth, blockHeight);
+
+  MipFilter mipFilter = MipFilter::Mitchell;
+  if (options.count("--mip-filter") && !ParseMipFilter(options["--mip-filter"], mipFilter)) {
+    std::cout << "Invalid mip filter: " << options["--mip-filter"] << std::endl;
+    return 1;
+  }
+
+  int zstdLevel = 0;
+  if (options.count("--zstd")) {
+    zstdLevel = options["--zstd"].empty() ? 19 : atoi(options["--zstd"].c_str());
+    if (zstdLevel < 1 || zstdLevel > ZSTD_maxCLevel()) {
+      std::cout << "Invalid zstd level: " << options["--zstd"] << std::endl;
+      return 1;
+    }
+  }
+
+  bool stream = options.count("--stream") != 0;
+  if (stream && zstdLevel != 0) {
+    std::cout << "--stream can't be combined with --zstd, supercompression needs whole levels in memory." << std::endl;
+    return 1;
+  }
+
+  float adaptiveThreshold = 0.0f;
+  if (options.count("--adaptive")) {
+    if (formatString != "BC6H" && formatString.substr(0, 3) != "BC7") {
+      std::cout << "--adaptive only applies to BC6H and BC7." << std::endl;
+      return 1;
+    }
+
+    adaptiveThreshold = options["--adaptive"].empty() ? 2.0f : (float)atof(options["--adaptive"].c_str());
+    if (adaptiveThreshold <= 0.0f) {
+      std::cout << "Invalid adaptive threshold: " << options["--adaptive"] << std::endl;
+      return 1;
+    }
+  }
+
+  /* Speed picked from a sample of the first input, fastest first */
+  float targetError = 0.0f;
+  if (options.count("--target-error") || options.count("--target-psnr")) {
+    if (formatString != "BC6H" && formatString.substr(0, 3) != "BC7") {
+      std::cout << "--target-error and --target-psnr only apply to BC6H and BC7." << std::endl;
+      return 1;
+    }
+
+    if (options.count("--target-psnr")) {
+      if (hdr) {
+        std::cout << "--target-psnr doesn't apply to HDR, use --target-error." << std::endl;
+        return 1;
+      }
+
+      float psnr = (float)atof(options["--target-psnr"].c_str());
+      if (psnr <= 0.0f) {
+        std::cout << "Invalid target PSNR: " << options["--target-psnr"] << std::endl;
+        return 1;
+      }
+      targetError = 255.0f / powf(10.0f, psnr / 20.0f);
+    } else {
+      targetError = (float)atof(options["--target-error"].c_str());
+      if (targetError <= 0.0f) {
+        std::cout << "Invalid target error: " << options["--target-error"] << std::endl;
+        return 1;
+      }
+    }
+
+    if (adaptiveThreshold > 0.0f) {
+      std::cout << "--adaptive can't be combined with a target error." << std::endl;
+      return 1;
+    }
+  }
+
+  /* Speed per mip level, the last one repeating down the chain */
+  std::vector<int> mipSpeeds;
+  if (options.count("--mip-speeds")) {
+    if (formatString != "BC6H" && formatString.substr(0, 3) != "BC7") {
+      std::cout << "--mip-speeds only applies to BC6H and BC7." << std::endl;
+      return 1;
+    }
+
+    std::string list = options["--mip-speeds"];
+    size_t start = 0;
+    while (start <= list.length()) {
+      size_t end = std::min(list.find(',', start), list.length());
+      auto name = std::find(speedNames.begin(), speedNames.end(), list.substr(start, end - start));
+      if (name == speedNames.end()) {
+        std::cout << "Invalid mip speeds: " << list << std::endl;
+        return 1;
+      }
+      mipSpeeds.push_back((int)(name - speedNames.begin()));
+      start = end + 1;
+    }
+
+    if (targetError > 0.0f) {
+      std::cout << "--mip-speeds can't be combined with a target error." << std::endl;
+      return 1;
+    }
+  }
+
+  bool dedup = options.count("--dedup") != 0;
+  bool dedupLayers = dedup && options["--dedup"] == "layers";
+  if (dedup && !dedupLayers && !options["--dedup"].empty()) {
+    std::cout << "Invalid dedup mode: " << options["--dedup"] << std::endl;
+    return 1;
+  }
+
+  if (stream && dedup) {
+    std::cout << "--stream can't be combined with --dedup, the block cache grows with the area of the level." << std::endl;
+    return 1;
+  }
+
+  if (stream && targetError > 0.0f) {
+    std::cout << "--stream can't be combined with a target error, the first input is sampled before encoding." << std::endl;
+    return 1;
+  }
+
+  if (stream && (blockWidth != 4 || blockHeight != 4)) {
+    std::cout << "--stream only supports 4x4 blocks." << std::endl;
+    return 1;
+  }
+
+  /* Streaming can only halve with the SIMD kernel */
+  if (stream && !options.count("--mip-filter")) {
+    mipFilter = MipFilter::Kaiser;
+  }
+
+  if (stream && mipFilter == MipFilter::Mitchell) {
+    std::cout << "The mitchell filter can't be used with --stream." << std::endl;
+    return 1;
+  }
+
   for (int i = inputsStart; i < (int)(inputsStart + numInputs); i++) {
     inputs.push_back(std::string(argv[i]));
   }
@@ -141,486 +423,555 @@ int main(int argc, char ** argv)
   std::cout << "Output: " << output << std::endl;
   std::cout << "Format: " << formatString << std::endl;
   std::cout << "Speed: " << speed << std::endl;
+  if (!mipSpeeds.empty()) {
+    std::cout << "Mip speeds:";
+    for (int mipSpeed : mipSpeeds) {
+      std::cout << " " << speedNames[mipSpeed];
+    }
+    std::cout << std::endl;
+  }
+  if (zstdLevel != 0) {
+    std::cout << "Zstd level: " << zstdLevel << std::endl;
+  }
+  if (adaptiveThreshold > 0.0f) {
+    std::cout << "Adaptive: speed 3, refining above RMS error " << adaptiveThreshold << std::endl;
+  }
+  if (targetError > 0.0f) {
+    std::cout << "Target RMS error: " << targetError << std::endl;
+  }
+
+  bool calibrated = false;
+  if (options.count("--isa")) {
+    int isa;
+    if (!ParseIsa(options["--isa"], isa)) {
+      std::cout << "Invalid ISA: " << options["--isa"] << std::endl;
+      return 1;
+    }
+
+    if (!ISPCSetIsa(isa)) {
+      std::cout << "ISA not supported by this CPU: " << options["--isa"] << std::endl;
+      return 1;
+    }
+  } else {
+    /* Start on the target calibration found fastest for this format */
+    std::map<std::string, int> calibration;
+    std::string baseFormat = srgb ? formatString.substr(0, formatString.length() - 5) : formatString;
+    if (LoadCalibration(calibrationPath, calibrationKey, calibration) && calibration.count(baseFormat)) {
+      calibrated = ISPCSetIsa(calibration[baseFormat]);
+    }
+  }
 
   int isa;
   isa = ISPCIsa();
 
   std::string isaName;
   switch(isa) {
-    case 0:
+    case ISPC_ISA_SSE2:
       isaName = "SSE2";
       break;
-    case 1:
+    case ISPC_ISA_SSE4:
       isaName = "SSE4";
       break;
-    case 2:
+    case ISPC_ISA_AVX2:
       isaName = "AVX2";
       break;
+    case ISPC_ISA_AVX512SKX:
+      isaName = "AVX-512 (Skylake)";
+      break;
+    case ISPC_ISA_AVX512ICL:
+      isaName = "AVX-512 (Ice Lake)";
+      break;
     default:
       isaName = "Unknown";
   };
 
-  std::cout << "ISPC ISA: " << isaName << std::endl;
+  std::cout << "ISPC ISA: " << isaName << (calibrated ? " (calibrated)" : "") << std::endl;
 
-  unsigned char * ldrBufferA, * ldrBufferB, * ldrBufferMain, * ldrBufferOther;
-  float * hdrBufferA, * hdrBufferB, * hdrBufferMain, * hdrBufferOther;
-  int width, height, channels;
-
-  int copyChannels = 4;
+  int width = 0, height = 0;
   int forcedChannels = 4;
-  if (formatString == "BC4") {
-    copyChannels = 1;
-  } else if (formatString == "BC5") {
-    copyChannels = 2;
-  }
 
-  std::vector<std::vector<std::vector<unsigned char>>> ldrLevels;
-  std::vector<std::vector<std::vector<float>>> hdrLevels;
+  /* Read the headers up front, the level layout is needed before the first
+     input has finished decoding. */
+  std::vector<std::unique_ptr<BandReader>> readers(numInputs);
+  for (int input = 0; input < numInputs; input++) {
+    int inputWidth, inputHeight, inputChannels;
+    if (stream) {
+      readers[input] = BandReader::Open(inputs[input], hdr);
+      if (readers[input] == nullptr) {
+        std::cout << "Failed to load image: " << inputs[input] << std::endl;
+        std::cout << "--stream reads Radiance HDR, binary PGM/PPM, PFM and non-interlaced PNG." << std::endl;
+        return 1;
+      }
 
-  std::vector<std::vector<std::vector<std::vector<unsigned char>>>> ldrLevelBlocks;
-  std::vector<std::vector<std::vector<std::vector<uint16_t>>>> hdrLevelBlocks;
+      inputWidth = readers[input]->Width();
+      inputHeight = readers[input]->Height();
+      inputChannels = readers[input]->Channels();
+    } else if (!stbi_info(inputs[input].c_str(), &inputWidth, &inputHeight, &inputChannels)) {
+      std::cout << "Failed to load image: " << inputs[input] << std::endl;
+      return 1;
+    }
 
-  if (hdr) {
-    hdrLevels.resize(numInputs);
-    hdrLevelBlocks.resize(numInputs);
-  } else {
-    ldrLevels.resize(numInputs);
-    ldrLevelBlocks.resize(numInputs);
+    if (input == 0) {
+      width = inputWidth;
+      height = inputHeight;
+    } else if (inputWidth != width || inputHeight != height) {
+      std::cout << "Image size doesn't match the first input: " << inputs[input] << std::endl;
+      return 1;
+    }
   }
 
-  uint32_t levelCount;
+  std::vector<int> levelWidths(1, width);
+  std::vector<int> levelHeights(1, height);
+  while (levelWidths.back() > 1 || levelHeights.back() > 1) {
+    levelWidths.push_back(std::max(1, (int)floorf((float)levelWidths.back() / 2)));
+    levelHeights.push_back(std::max(1, (int)floorf((float)levelHeights.back() / 2)));
+  }
+  uint32_t levelCount = levelWidths.size();
+
+  std::tuple<std::string, int, vk::Format> format = formats.find(formatString)->second;
+  size_t blockSize = std::get<1>(format);
+  MipGenerator mipGenerator(mipFilter, srgb, hdr);
+
+  /* Number of block rows handed to the compressor per tile. Each tile covers
+     the full width of the level, so the ISPC gangs stay full. */
+  const unsigned int stripBlockRows = 4;
+
+  /* Levels are stored with their rows padded out to whole blocks, so the
+     compressors can read them in place. HDR levels are half floats, which is
+     what BC6H takes. */
+  std::vector<std::vector<rgba_surface>> levelSurfaces(numInputs, std::vector<rgba_surface>(levelCount));
+  std::vector<size_t> levelBytes(levelCount);
+  std::vector<size_t> levelImageSizes(levelCount);
+  std::vector<std::atomic<unsigned int>> tilesRemaining(numInputs * levelCount);
+  std::vector<std::atomic<unsigned int>> levelUsers(numInputs * levelCount);
+  std::vector<std::atomic<unsigned int>> inputTilesRemaining(numInputs);
+  size_t totalBlocks = 0;
 
   for (int input = 0; input < numInputs; input++) {
-    int level = 0;
+    for (unsigned int l = 0; l < levelCount; l++) {
+      unsigned int blocksWidth = (levelWidths[l] + blockWidth - 1) / blockWidth;
+      unsigned int blocksHeight = (levelHeights[l] + blockHeight - 1) / blockHeight;
+
+      rgba_surface & surface = levelSurfaces[input][l];
+      surface.width = blocksWidth * blockWidth;
+      surface.height = blocksHeight * blockHeight;
+      surface.stride = surface.width * forcedChannels * (hdr ? sizeof(uint16_t) : 1);
+
+      levelBytes[l] = surface.height * surface.stride;
+      levelImageSizes[l] = blocksWidth * blocksHeight * blockSize;
+      tilesRemaining[input * levelCount + l] = (blocksHeight + stripBlockRows - 1) / stripBlockRows;
+      inputTilesRemaining[input] += (blocksHeight + stripBlockRows - 1) / stripBlockRows;
+      /* A level is read until it is compressed and the next level is built */
+      levelUsers[input * levelCount + l] = l + 1 < levelCount ? 2 : 1;
+      totalBlocks += blocksWidth * blocksHeight;
+    }
+  }
 
-    std::cout << "Loading/scaling " << input << ": " << inputs[input] << std::endl;
+  /* Decodes an input into its padded level 0 surface */
+  auto decodeInput = [&](int input, rgba_surface & surface, int & inputChannels) {
+    int inputWidth, inputHeight;
 
     if (hdr) {
-      hdrBufferA = stbi_loadf(inputs[input].c_str(), &width, &height, &channels, forcedChannels);
-      if (hdrBufferA == nullptr) {
+      float * hdrBuffer = stbi_loadf(inputs[input].c_str(), &inputWidth, &inputHeight, &inputChannels, forcedChannels);
+      if (hdrBuffer == nullptr) {
         std::cout << "Failed to load image: " << inputs[input] << std::endl;
-        return 1;
+        return false;
+      }
+
+      for (int y = 0; y < height; y++) {
+        uint16_t * row = (uint16_t *)(surface.ptr + y * surface.stride);
+        for (int x = 0; x < width * forcedChannels; x++) {
+          row[x] = HalfFloat::FromFloat(std::min(std::max(hdrBuffer[y * width * forcedChannels + x], 0.0f), 65504.0f));
+        }
       }
+      free(hdrBuffer);
 
-      hdrBufferB = new float[width * height * forcedChannels];
-      hdrBufferMain = hdrBufferA;
-      hdrBufferOther = hdrBufferB;
+      PadToBlocks(surface, width, height, forcedChannels * sizeof(uint16_t) * 8, blockWidth, blockHeight);
     } else {
-      ldrBufferA = stbi_load(inputs[input].c_str(), &width, &height, &channels, forcedChannels);
-      if (ldrBufferA == nullptr) {
+      unsigned char * ldrBuffer = stbi_load(inputs[input].c_str(), &inputWidth, &inputHeight, &inputChannels, forcedChannels);
+      if (ldrBuffer == nullptr) {
         std::cout << "Failed to load image: " << inputs[input] << std::endl;
-        return 1;
+        return false;
+      }
+
+      for (int y = 0; y < height; y++) {
+        std::copy(ldrBuffer + y * width * forcedChannels, ldrBuffer + (y + 1) * width * forcedChannels, surface.ptr + y * surface.stride);
       }
+      free(ldrBuffer);
 
-      ldrBufferB = new unsigned char[width * height * forcedChannels];
-      ldrBufferMain = ldrBufferA;
-      ldrBufferOther = ldrBufferB;
+      PadToBlocks(surface, width, height, forcedChannels * 8, blockWidth, blockHeight);
     }
+    return true;
+  };
 
-    int oldWidth = width;
-    int oldHeight = height;
+  if (targetError > 0.0f) {
+    std::vector<uint8_t> sampleTexels(levelBytes[0]);
+    rgba_surface sample = levelSurfaces[0][0];
+    sample.ptr = sampleTexels.data();
 
-    levelCount = 1;
-    {
-      int levelWidth = width;
-      int levelHeight = height;
-      while (levelWidth > 1 || levelHeight > 1) {
-        levelWidth = std::max(1, (int)floorf((float)levelWidth / 2));
-        levelHeight = std::max(1, (int)floorf((float)levelHeight / 2));
-        levelCount++;
-      }
+    int sampleChannels;
+    if (!decodeInput(0, sample, sampleChannels)) {
+      return 1;
     }
-    
-    while(1) {
-      if (hdr) {
-        hdrLevels[input].push_back(std::vector<float>(hdrBufferMain, hdrBufferMain + oldWidth * oldHeight * forcedChannels));
-      } else {
-        ldrLevels[input].push_back(std::vector<uint8_t>(ldrBufferMain, ldrBufferMain + oldWidth * oldHeight * forcedChannels));
-      }
 
-      if (oldWidth == 1 && oldHeight == 1) {
-        break;
-      }
+    std::vector<float> rmse;
+    Compressor probe(formatString, blockSize, speed);
+    speed = probe.PickSpeed(sample, targetError, rmse);
 
-      int newWidth = std::max(1, (int)floorf((float)oldWidth / 2));
-      int newHeight = std::max(1, (int)floorf((float)oldHeight / 2));
+    for (int s = (int)rmse.size() - 1; s >= 0; s--) {
+      if (rmse[s] >= 0.0f) {
+        std::cout << "  " << speedNames[s] << ": RMS error " << rmse[s] << std::endl;
+      }
+    }
+    std::cout << "Picked speed: " << speedNames[speed] << std::endl;
+  }
 
-      stbir_colorspace colorspace = srgb ? STBIR_COLORSPACE_SRGB : STBIR_COLORSPACE_LINEAR;
-      int alphaChannel = channels == 4 ? 3 : STBIR_ALPHA_CHANNEL_NONE;
+  /* One compressor per level, so each level can have its own speed and keeps
+     its own time and error. Adaptive encoding starts every block on the fast
+     profile. */
+  std::vector<int> levelSpeeds(levelCount);
+  std::vector<std::unique_ptr<Compressor>> compressors;
+  for (uint32_t l = 0; l < levelCount; l++) {
+    levelSpeeds[l] = mipSpeeds.empty() ? speed : mipSpeeds[std::min((size_t)l, mipSpeeds.size() - 1)];
+    compressors.push_back(std::make_unique<Compressor>(formatString, blockSize, adaptiveThreshold > 0.0f ? 3 : levelSpeeds[l]));
+    if (adaptiveThreshold > 0.0f) {
+      compressors.back()->SetRefinement(levelSpeeds[l], adaptiveThreshold);
+    }
+    compressors.back()->SetMeasureError(!mipSpeeds.empty());
+  }
 
-      if (hdr) {
-        int rv = stbir_resize_float_generic(hdrBufferMain, oldWidth, oldHeight, 0, hdrBufferOther, newWidth, newHeight, 0, forcedChannels, alphaChannel, 0, STBIR_EDGE_CLAMP, STBIR_FILTER_MITCHELL, colorspace, nullptr);
-        if (rv != 1) {
-          std::cerr << "Error resizing" << std::endl;
-        }
-        std::swap(hdrBufferMain, hdrBufferOther);
-      } else {
-        int rv = stbir_resize_uint8_generic(ldrBufferMain, oldWidth, oldHeight, 0, ldrBufferOther, newWidth, newHeight, 0, forcedChannels, alphaChannel, 0, STBIR_EDGE_CLAMP, STBIR_FILTER_MITCHELL, colorspace, nullptr);
-        if (rv != 1) {
-          std::cerr << "Error resizing" << std::endl;
+  /* Levels with fewer blocks than a batch are packed together across levels
+     and inputs, each into the group of the first packed level with the same
+     speed, whose compressor they share. The block caches are per level, so
+     with --dedup every level is compressed in place. */
+  const unsigned int tailBatchBlocks = 256;
+  std::vector<int> tailGroups(levelCount, -1);
+  for (uint32_t l = 0; l < levelCount && !dedup && !stream; l++) {
+    if ((levelSurfaces[0][l].width / blockWidth) * (levelSurfaces[0][l].height / blockHeight) < tailBatchBlocks) {
+      tailGroups[l] = l;
+      for (uint32_t g = 0; g < l; g++) {
+        if (tailGroups[g] == (int)g && levelSpeeds[g] == levelSpeeds[l]) {
+          tailGroups[l] = g;
+          break;
         }
-        std::swap(ldrBufferMain, ldrBufferOther);
       }
+    }
+  }
 
-      oldWidth = newWidth;
-      oldHeight = newHeight;
-      level++;
+  TailPacker tails(blockWidth, blockHeight, blockWidth * blockHeight * forcedChannels * (hdr ? sizeof(uint16_t) : 1), blockSize, tailBatchBlocks);
+  std::vector<std::atomic<unsigned int>> tailBlocksRemaining(numInputs * levelCount);
+  for (int input = 0; input < numInputs; input++) {
+    for (uint32_t l = 0; l < levelCount; l++) {
+      tailBlocksRemaining[input * levelCount + l] = (levelSurfaces[input][l].width / blockWidth) * (levelSurfaces[input][l].height / blockHeight);
     }
+  }
 
-    oldWidth = width;
-    oldHeight = height;
-    level = 0;
-    if (hdr) {
-      free(hdrBufferA);
-       delete[] hdrBufferB;
+  uint32_t layerCount;
+  uint32_t faceCount;
+  if (numInputs > 1) {
+    if (option == "cube") {
+      layerCount = 0;
+      faceCount = 6;
     } else {
-      free(ldrBufferA);
-      delete[] ldrBufferB;
+      layerCount = numInputs;
+      faceCount = 1;
     }
+  } else {
+    layerCount = 0;
+    faceCount = 1;
   }
 
-  bc6h_enc_settings bc6henc;
-  bc7_enc_settings bc7enc;
+  /* The output is sized and mapped up front, each tile is compressed straight
+     to its final offset in the file. When supercompressing, each image is
+     compressed by whichever worker finishes its last tile. */
+  vk::Format vkformat = std::get<2>(format);
+  Ktx2Writer writer(*(VkFormat *)&vkformat, blockSize, width, height, layerCount, faceCount, levelImageSizes, zstdLevel);
+  if (!writer.Open(output)) {
+    std::cout << "Failed to open output file: " << output << std::endl;
+    return 1;
+  }
 
-  if (formatString == "BC6H") {
-    if (speed == 0) {
-      GetProfile_bc6h_veryslow(&bc6henc);
-    } else if (speed == 1) {
-      GetProfile_bc6h_slow(&bc6henc);
-    } else if (speed == 2) {
-      GetProfile_bc6h_basic(&bc6henc);
-    } else if (speed == 3) {
-      GetProfile_bc6h_fast(&bc6henc);
+  ThreadPool pool;
+
+  /* Each input in flight holds its whole mip chain until it is compressed, so
+     the number of inputs decoded ahead is what bounds peak memory. */
+  int decodeThreads = std::min(pool.Size(), 4u);
+  if (options.count("--decode-threads")) {
+    decodeThreads = atoi(options["--decode-threads"].c_str());
+    if (decodeThreads < 1) {
+      std::cout << "Invalid decode threads: " << options["--decode-threads"] << std::endl;
+      return 1;
     }
-  } else {
-    if (channels == 3) {
-      if (speed == 0 || speed == 1) {
-        GetProfile_slow(&bc7enc);
-      } else if (speed == 2) {
-        GetProfile_basic(&bc7enc);
-      } else if (speed == 3) {
-        GetProfile_fast(&bc7enc);
-      }
-    } else {
-      if (speed == 0 || speed == 1) {
-        GetProfile_alpha_slow(&bc7enc);
-      } else if (speed == 2) {
-        GetProfile_alpha_basic(&bc7enc);
-      } else if (speed == 3) {
-        GetProfile_alpha_fast(&bc7enc);
-      }
+  }
+  decodeThreads = std::min(decodeThreads, numInputs);
+
+  /* One arena per input in flight, handed on to the next input when its
+     chain is done. Streaming only needs its rings of rows. */
+  std::vector<std::unique_ptr<MipArena>> arenas;
+  for (int i = 0; i < (stream ? 0 : decodeThreads); i++) {
+    arenas.push_back(std::make_unique<MipArena>(levelBytes));
+    if (!arenas.back()->Valid()) {
+      std::cout << "Failed to allocate memory for the mip chain" << std::endl;
+      return 1;
     }
   }
-
-  std::vector<std::vector<std::vector<unsigned char>>> levelBlocksCompressed(numInputs);
-  std::tuple<std::string, int, vk::Format> format = formats.find(formatString)->second;
-  size_t blockSize = std::get<1>(format);
-
-  for (int input = 0; input < numInputs; input++) {
-    if (numInputs > 1) {
-      if (option == "cube") {
-        std::cout << "Face " << input << std::endl;
-      } else {
-        std::cout << "Layer " << input << std::endl;
-      }
+  std::vector<int> inputArena(numInputs);
+
+  /* Compressed blocks are looked up by their texels, in a cache per level and
+     input, or per level with --dedup=layers. A cache is emptied once every
+     image using it has been compressed. */
+  std::vector<std::unique_ptr<BlockCache>> blockCaches;
+  std::vector<std::atomic<unsigned int>> cacheUsers(dedupLayers ? levelCount : numInputs * levelCount);
+  auto cacheIndex = [&](int input, uint32_t l) { return dedupLayers ? l : input * levelCount + l; };
+  if (dedup) {
+    for (size_t i = 0; i < cacheUsers.size(); i++) {
+      blockCaches.push_back(std::make_unique<BlockCache>(compressors[0]->BlockKeySize(), blockSize));
+      cacheUsers[i] = dedupLayers ? numInputs : 1;
     }
+  }
 
-    if (hdr) {
-      hdrLevelBlocks[input].resize(levelCount);
-    } else {
-      ldrLevelBlocks[input].resize(levelCount);
-    }
-    int level = 0;
+  std::cout << "Compressing " << totalBlocks << " blocks on " << pool.Size() << " threads" << std::endl;
 
-    int oldWidth = width;
-    int oldHeight = height;
+  Progress progress(totalBlocks, pool.Size(), options.count("--no-progress") == 0);
 
-    while(1) {
-      unsigned int blocksWidth = (oldWidth + 3) / 4;
-      unsigned int blocksHeight = (oldHeight + 3) / 4;
+  std::atomic<bool> failed(false);
 
-      if (hdr) {
-        hdrLevelBlocks[input][level].resize(blocksWidth * blocksHeight);
-
-        for (unsigned int y = 0; y < blocksHeight; y++) {
-          for (unsigned int x = 0; x < blocksWidth; x++) {
-            std::vector<uint16_t> block(16 * copyChannels);
-
-            for (unsigned int pixelY = y * 4; pixelY < y * 4 + 4; pixelY++) {
-              for (unsigned int pixelX = x * 4; pixelX < x * 4 + 4; pixelX++) {
-                unsigned int clampedY = std::min(pixelY, (unsigned int)oldHeight - 1);
-                unsigned int clampedX = std::min(pixelX, (unsigned int)oldWidth - 1);
-
-                for (int channel = 0; channel < copyChannels; channel++) {
-                  float value = hdrLevels[input][level][(clampedY * oldWidth + clampedX) * forcedChannels + channel];
-                  if (value < 0.0f) {
-                    value = 0.0f;
-                  }
-
-                  if (value > 65504.0f) {
-                    value = 65504.0f;
-                  }
-
-                  block[((pixelY % 4) * 4 + (pixelX % 4)) * copyChannels + channel] = HalfFloat::FromFloat(value);
-                }
-              }
-            }
+  std::atomic<int> nextInput(0);
+  std::function<void(int)> startNextInput;
 
-            hdrLevelBlocks[input][level][blocksWidth * y + x] = block;
-          }
-        }
-      } else {
-        ldrLevelBlocks[input][level].resize(blocksWidth * blocksHeight);
-
-        for (unsigned int y = 0; y < blocksHeight; y++) {
-          for (unsigned int x = 0; x < blocksWidth; x++) {
-            std::vector<uint8_t> block(16 * copyChannels);
-
-            for (unsigned int pixelY = y * 4; pixelY < y * 4 + 4; pixelY++) {
-              for (unsigned int pixelX = x * 4; pixelX < x * 4 + 4; pixelX++) {
-                unsigned int clampedY = std::min(pixelY, (unsigned int)oldHeight - 1);
-                unsigned int clampedX = std::min(pixelX, (unsigned int)oldWidth - 1);
-
-                for (int channel = 0; channel < copyChannels; channel++) {
-                  block[((pixelY % 4) * 4 + (pixelX % 4)) * copyChannels + channel] = ldrLevels[input][level][(clampedY * oldWidth + clampedX) * forcedChannels + channel];
-                }
-              }
-            }
+  auto releaseLevel = [&](int input, uint32_t l) {
+    if (--levelUsers[input * levelCount + l] == 0) {
+      arenas[inputArena[input]]->Release(l);
+    }
+  };
 
-            ldrLevelBlocks[input][level][blocksWidth * y + x] = block;
-          }
+  /* Packed levels are finished once the batches holding their last blocks
+     have been compressed */
+  auto compressBatch = [&](const TailPacker::Batch & batch) {
+    tails.Compress(*compressors[batch.group], batch);
+
+    for (auto & segment : batch.segments) {
+      progress.Add(segment.blocks);
+      if ((tailBlocksRemaining[segment.image] -= segment.blocks) == 0) {
+        if (!writer.FinishImage(segment.image % levelCount, segment.image / levelCount)) {
+          std::cout << "Zstd compression failed" << std::endl;
+          failed = true;
         }
       }
+    }
+  };
 
-      if (oldWidth == 1 && oldHeight == 1) {
-        break;
-      }
-
-      oldWidth = std::max(1, (int)floorf((float)oldWidth / 2));
-      oldHeight = std::max(1, (int)floorf((float)oldHeight / 2));      
-      level++;
+  auto submitBatches = [&](std::vector<TailPacker::Batch> & batches) {
+    for (auto & batch : batches) {
+      auto shared = std::make_shared<TailPacker::Batch>(std::move(batch));
+      pool.Submit([&, shared](){ compressBatch(*shared); });
     }
+  };
 
+  auto compressTile = [&](int input, uint32_t l, unsigned int row, unsigned int rows) {
+    unsigned int blocksWidth = levelSurfaces[input][l].width / blockWidth;
+    BlockCache * cache = dedup ? blockCaches[cacheIndex(input, l)].get() : nullptr;
+    if (tailGroups[l] < 0) {
+      compressors[l]->CompressStrip(levelSurfaces[input][l], row, rows, writer.Image(l, input) + row * blocksWidth * blockSize, cache);
+      progress.Add(rows * blocksWidth);
+    }
 
-    /* Compress */
-    levelBlocksCompressed[input].resize(levelCount);
-    for (unsigned int l = 0; l < levelCount; l++) {
-      if (hdr) {
-        levelBlocksCompressed[input][l].resize(hdrLevelBlocks[input][l].size() * blockSize);
-      } else {
-        levelBlocksCompressed[input][l].resize(ldrLevelBlocks[input][l].size() * blockSize);
+    if (--tilesRemaining[input * levelCount + l] == 0) {
+      if (tailGroups[l] >= 0) {
+        std::vector<TailPacker::Batch> full;
+        tails.Add(tailGroups[l], levelSurfaces[input][l], writer.Image(l, input), input * levelCount + l, full);
+        submitBatches(full);
+      } else if (!writer.FinishImage(l, input)) {
+        std::cout << "Zstd compression failed" << std::endl;
+        failed = true;
+      }
+      releaseLevel(input, l);
+      if (cache != nullptr && --cacheUsers[cacheIndex(input, l)] == 0) {
+        cache->Clear();
       }
     }
 
-    std::mutex mutex;
-    std::vector<unsigned int> completedBlocks(levelCount, 0);
-
-    unsigned int numThreads = std::thread::hardware_concurrency();
-    std::vector<std::thread> threads;
-    unsigned int maxLevel = 0;
-    for (unsigned t = 0; t < numThreads; t++) {
-      threads.push_back(std::thread([&, t](){
-        for (unsigned int l = 0; l < levelCount; l++) {
-          unsigned int blocksPerThread;
-          if (hdr) {
-            blocksPerThread = hdrLevelBlocks[input][l].size() / numThreads;
-          } else {
-            blocksPerThread = ldrLevelBlocks[input][l].size() / numThreads;
-          }
-          unsigned int startBlock = t * blocksPerThread;
-          unsigned int endBlock = startBlock + blocksPerThread;
+    /* The whole chain has been compressed, hand its arena to the next input */
+    if (--inputTilesRemaining[input] == 0) {
+      startNextInput(inputArena[input]);
+    }
+  };
 
-          if (hdr) {
-            if (t == numThreads - 1) {
-              endBlock = hdrLevelBlocks[input][l].size();
-            }
-          } else {
-            if (t == numThreads - 1) {
-              endBlock = ldrLevelBlocks[input][l].size();
-            }
-          }
+  auto compressLevel = [&](int input, uint32_t l) {
+    unsigned int blocksHeight = levelSurfaces[input][l].height / blockHeight;
 
-          for (unsigned int b = startBlock; b < endBlock; b++) {
-            if (formatString == "BC6H") {
-              rgba_surface surface;
-              surface.ptr = (uint8_t *)hdrLevelBlocks[input][l][b].data();
-              surface.width = 4;
-              surface.height = 4;
-              surface.stride = copyChannels * 4 * 2;
-
-              CompressBlocksBC6H(&surface, &levelBlocksCompressed[input][l][b * blockSize], &bc6henc);
-            } else {
-              rgba_surface surface;
-              surface.ptr = ldrLevelBlocks[input][l][b].data();
-              surface.width = 4;
-              surface.height = 4;
-              surface.stride = copyChannels * 4;
-
-              if (formatString == "BC1" || formatString == "BC1_SRGB") {
-                CompressBlocksBC1(&surface, &levelBlocksCompressed[input][l][b * blockSize]);
-              } else if (formatString == "BC3" || formatString == "BC3_SRGB") {
-                CompressBlocksBC3(&surface, &levelBlocksCompressed[input][l][b * blockSize]);
-              } else if (formatString == "BC4") {
-                CompressBlocksBC4(&surface, &levelBlocksCompressed[input][l][b * blockSize]);
-              } else if (formatString == "BC5") {
-                CompressBlocksBC5(&surface, &levelBlocksCompressed[input][l][b * blockSize]);
-              } else if (formatString == "BC7" || formatString == "BC7_SRGB") {
-                CompressBlocksBC7(&surface, &levelBlocksCompressed[input][l][b * blockSize], &bc7enc);
-              }
-            }
+    for (unsigned int row = 0; row < blocksHeight; row += stripBlockRows) {
+      unsigned int rows = std::min(stripBlockRows, blocksHeight - row);
+      pool.Submit([&, input, l, row, rows](){ compressTile(input, l, row, rows); });
+    }
+  };
 
-            std::lock_guard<std::mutex> lock(mutex);
-            completedBlocks[l]++;
-            if (completedBlocks[l] % 100 == 0) {
-              maxLevel = std::max(l, maxLevel);
-              if (l == maxLevel) {
-                float progress;
-                if (hdr) {
-                  progress = (float)completedBlocks[l] / hdrLevelBlocks[input][l].size();
-                } else {
-                  progress = (float)completedBlocks[l] / ldrLevelBlocks[input][l].size();
-                }
-                int barWidth = 70;
-
-                std::cout << std::setw(2) << l << " [";
-                int pos = (int)(barWidth * progress);
-                for (int i = 0; i < barWidth; ++i) {
-                    if (i < pos) std::cout << "=";
-                    else if (i == pos) std::cout << ">";
-                    else std::cout << " ";
-                }
-                std::cout << "] " << std::setw(2) << int(progress * 100.0) << " %\r";
-                std::cout.flush();
-              }
+  /* Each level is compressed as soon as it exists, and the next level is
+     downsampled while its tiles are being compressed. Tasks pushed last are
+     popped first by the same worker, so the mip chain stays on the critical
+     path while idle workers steal the older tiles.
+
+     Levels the 2x kernel can handle are built one tile's worth of rows per
+     task, and each band is compressed straight after it is written. */
+  std::function<void(int, uint32_t, bool)> generateLevel = [&](int input, uint32_t level, bool alpha) {
+    rgba_surface & surface = levelSurfaces[input][level];
+    int bpp = hdr ? forcedChannels * sizeof(uint16_t) * 8 : forcedChannels * 8;
+    int srcWidth = levelWidths[level - 1];
+    int srcHeight = levelHeights[level - 1];
+
+    if (mipGenerator.CanHalve(srcWidth, srcHeight)) {
+      unsigned int blocksHeight = surface.height / blockHeight;
+      auto remaining = std::make_shared<std::atomic<unsigned int>>((blocksHeight + stripBlockRows - 1) / stripBlockRows);
+
+      for (unsigned int row = 0; row < blocksHeight; row += stripBlockRows) {
+        unsigned int rows = std::min(stripBlockRows, blocksHeight - row);
+
+        pool.Submit([&, input, level, alpha, bpp, srcWidth, srcHeight, row, rows, remaining](){
+          rgba_surface & surface = levelSurfaces[input][level];
+          int firstY = row * blockHeight;
+          int lastY = std::min((int)(row + rows) * blockHeight, levelHeights[level]);
+
+          mipGenerator.Halve(levelSurfaces[input][level - 1], srcWidth, srcHeight, surface, levelWidths[level], firstY, lastY - firstY, alpha);
+
+          rgba_surface band = surface;
+          band.ptr += firstY * surface.stride;
+          band.height = rows * blockHeight;
+          PadToBlocks(band, levelWidths[level], lastY - firstY, bpp, blockWidth, blockHeight);
+
+          if (--*remaining == 0) {
+            releaseLevel(input, level - 1);
+            if (level + 1 < levelCount) {
+              pool.Submit([&, input, level, alpha](){ generateLevel(input, level + 1, alpha); });
             }
           }
-        }
-      }));
+
+          compressTile(input, level, row, rows);
+        });
+      }
+    } else {
+      if (!mipGenerator.Resize(levelSurfaces[input][level - 1], srcWidth, srcHeight, surface, levelWidths[level], levelHeights[level], alpha)) {
+        std::cerr << "Error resizing" << std::endl;
+      }
+      PadToBlocks(surface, levelWidths[level], levelHeights[level], bpp, blockWidth, blockHeight);
+      releaseLevel(input, level - 1);
+
+      compressLevel(input, level);
+      if (level + 1 < levelCount) {
+        pool.Submit([&, input, level, alpha](){ generateLevel(input, level + 1, alpha); });
+      }
     }
+  };
 
-    for (unsigned t = 0; t < numThreads; t++) {
-      threads[t].join();
+  /* Up to decodeThreads inputs are decoded in parallel, and each input that
+     finishes compressing starts the next one, so decoding overlaps with the
+     downsampling and compression of the inputs before it. */
+  std::function<void(int)> loadInput = [&](int input) {
+    int inputChannels;
+    if (!decodeInput(input, levelSurfaces[input][0], inputChannels)) {
+      failed = true;
+      return;
     }
 
-    if (hdr) {
-      hdrLevelBlocks[input].clear();
-    } else {
-      ldrLevelBlocks[input].clear();
+    compressLevel(input, 0);
+    if (levelCount > 1) {
+      bool alpha = inputChannels == 4;
+      pool.Submit([&, input, alpha](){ generateLevel(input, 1, alpha); });
+    }
+  };
+
+  startNextInput = [&](int arena) {
+    int input = nextInput++;
+    if (input < numInputs && !failed) {
+      inputArena[input] = arena;
+      for (uint32_t l = 0; l < levelCount; l++) {
+        levelSurfaces[input][l].ptr = arenas[arena]->Level(l);
+      }
+      pool.Submit([&, input](){ loadInput(input); });
     }
+  };
 
-    int barWidth = 70;
-    std::cout << std::setw(2) << (levelCount - 1) << " [";
-    int pos = barWidth;
-    for (int i = 0; i < barWidth; ++i) {
-        if (i < pos) std::cout << "=";
-        else if (i == pos) std::cout << ">";
-        else std::cout << " ";
+  if (stream) {
+    StreamEncoder encoder(compressors, mipGenerator, writer, pool, progress, levelWidths, levelHeights, hdr, stripBlockRows);
+    if (!encoder.Valid()) {
+      std::cout << "Failed to allocate memory for the mip chain" << std::endl;
+      failed = true;
     }
-    std::cout << "] " << std::setw(2) << 100 << " %\r";
-    std::cout.flush();
 
-    std::cout << std::endl;
+    for (int input = 0; input < numInputs && !failed; input++) {
+      if (!encoder.Encode(*readers[input], input, readers[input]->Channels() == 4)) {
+        std::cout << "Failed to load image: " << inputs[input] << std::endl;
+        failed = true;
+      }
+      readers[input].reset();
+    }
+  } else {
+    for (int i = 0; i < decodeThreads; i++) {
+      startNextInput(i);
+    }
+    pool.Wait();
+
+    std::vector<TailPacker::Batch> remaining;
+    tails.Flush(remaining);
+    submitBatches(remaining);
+    pool.Wait();
   }
+  progress.Finish();
 
-  /* Write KTX2 */
-  std::ofstream fh (output, std::ios::out | std::ios::binary);
-  if (!fh.is_open()) {
-    std::cout << "Failed to open output file: " << output << std::endl;
+  if (failed) {
+    writer.Close();
+    std::remove(output.c_str());
     return 1;
   }
 
-  const uint8_t identifier[] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};  
-  fh.write((char *)identifier, sizeof(identifier));
-  vk::Format vkformat = std::get<2>(formats.at(formatString));
-  fh.write((char *)&vkformat, sizeof(vkformat));
-  uint32_t typeSize = 1; // Fix for uncompressed vkformats, size of an individual component
-  fh.write((char *)&typeSize, sizeof(typeSize));
-  uint32_t pixelWidth = width;
-  uint32_t pixelHeight = height;
-  uint32_t pixelDepth = 0;
+  if (!writer.Close()) {
+    std::cout << "Failed to write output file: " << output << std::endl;
+    std::remove(output.c_str());
+    return 1;
+  }
 
-  uint32_t layerCount;
-  uint32_t faceCount;
-  if (numInputs > 1) {
-    if (option == "cube") {
-      layerCount = 0;
-      faceCount = 6;
-    } else {
-      layerCount = numInputs;
-      faceCount = 1;
+  if (compressors[0]->Refines()) {
+    size_t refinedBlocks = 0;
+    for (auto & compressor : compressors) {
+      refinedBlocks += compressor->RefinedBlocks();
     }
-  } else {
-    layerCount = 0;
-    faceCount = 1;
+    std::cout << "Refined blocks: " << refinedBlocks << " of " << totalBlocks << std::endl;
   }
-  uint32_t supercompressionScheme = 0;
-  fh.write((char *)&pixelWidth, sizeof(pixelWidth));
-  fh.write((char *)&pixelHeight, sizeof(pixelHeight));
-  fh.write((char *)&pixelDepth, sizeof(pixelDepth));
-  fh.write((char *)&layerCount, sizeof(layerCount));
-  fh.write((char *)&faceCount, sizeof(faceCount));
-  fh.write((char *)&levelCount, sizeof(levelCount));
-  fh.write((char *)&supercompressionScheme, sizeof(supercompressionScheme));
-
-  uint32_t * dfd = vk2dfd(*(VkFormat *)&vkformat);
-
-  uint32_t dfdByteOffset = 0;
-  uint32_t dfdByteLength = dfd[0];
-  uint32_t kvdByteOffset = 0;
-  uint32_t kvdByteLength = 0;
-  uint64_t sgdByteOffset = 0;
-  uint64_t sgdByteLength = 0;
-
-  auto dfdByteOffsetPosition = fh.tellp();
-
-  fh.write((char *)&dfdByteOffset, sizeof(dfdByteOffset));
-  fh.write((char *)&dfdByteLength, sizeof(dfdByteLength));
-  fh.write((char *)&kvdByteOffset, sizeof(kvdByteOffset));
-  fh.write((char *)&kvdByteLength, sizeof(kvdByteLength));
-  fh.write((char *)&sgdByteOffset, sizeof(sgdByteOffset));
-  fh.write((char *)&sgdByteLength, sizeof(sgdByteLength));
 
-  auto levelOffsetBytePosition = fh.tellp();
-  for (unsigned int i = 0; i < levelCount; i++) {
-    uint64_t byteOffset = 0;
-    uint64_t byteLength = 0;
-    uint64_t uncompressedByteLength = 0;
-    fh.write((char *)&byteOffset, sizeof(byteOffset));
-    fh.write((char *)&byteLength, sizeof(byteLength));
-    fh.write((char *)&uncompressedByteLength, sizeof(uncompressedByteLength));
+  /* Times are summed over the threads, levels are compressed concurrently.
+     Packed levels are counted in the first level of their group. */
+  if (!mipSpeeds.empty()) {
+    std::cout << "Levels:" << std::endl;
+    for (uint32_t l = 0; l < levelCount; l++) {
+      std::cout << "  Level " << l << " (" << levelWidths[l] << "x" << levelHeights[l] << ", " << speedNames[levelSpeeds[l]] << "): ";
+      if (tailGroups[l] >= 0 && tailGroups[l] != (int)l) {
+        std::cout << "packed with level " << tailGroups[l] << std::endl;
+        continue;
+      }
+      std::cout << std::fixed << std::setprecision(3) << compressors[l]->Seconds() << " s, RMS error "
+                << std::setprecision(2) << compressors[l]->Rmse() << std::endl;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
   }
 
-  dfdByteOffset = fh.tellp();
-  fh.write((char *)dfd, dfdByteLength);
-  free(dfd);
-
-  kvdByteOffset = fh.tellp();
-  fh.seekp(dfdByteOffsetPosition);
-  fh.write((char *)&dfdByteOffset, sizeof(dfdByteOffset));
-  fh.seekp(kvdByteOffset);
-
-  size_t alignment = std::lcm((size_t)4, (size_t)std::get<1>(formats.at(formatString)));
-
-  for (int level = levelCount - 1; level >= 0; level--) {
-    // Alignment
-    while (fh.tellp() % alignment != 0) {
-      uint8_t padding = 0;
-      fh.write((char *)&padding, sizeof(padding));
+  if (dedup) {
+    size_t blocks = 0;
+    size_t duplicates = 0;
+    for (auto & cache : blockCaches) {
+      blocks += cache->Blocks();
+      duplicates += cache->Duplicates();
     }
 
-    auto levelBytePosition = fh.tellp();
-    fh.seekp(levelOffsetBytePosition + (std::ofstream::pos_type)(level * 24));
-    uint64_t byteOffset = levelBytePosition;
-    fh.write((char *)&byteOffset, sizeof(byteOffset));
-    uint64_t byteLength = levelBlocksCompressed[0][level].size() * numInputs;
-    fh.write((char *)&byteLength, sizeof(byteLength));
-    fh.write((char *)&byteLength, sizeof(byteLength));
-    fh.seekp(levelBytePosition);
-
-    for (int input = 0; input < numInputs; input++) {
-      fh.write((char *)levelBlocksCompressed[input][level].data(), levelBlocksCompressed[input][level].size());
+    std::cout << "Duplicate blocks: " << duplicates << " of " << blocks << " (" << std::fixed << std::setprecision(1) << (blocks ? 100.0 * duplicates / blocks : 0.0) << "%)" << std::endl;
+    for (uint32_t l = 0; l < levelCount; l++) {
+      size_t levelBlocks = 0;
+      size_t levelDuplicates = 0;
+      for (int input = 0; input < (dedupLayers ? 1 : numInputs); input++) {
+        levelBlocks += blockCaches[cacheIndex(input, l)]->Blocks();
+        levelDuplicates += blockCaches[cacheIndex(input, l)]->Duplicates();
+      }
+      std::cout << "  Level " << l << ": " << levelDuplicates << " of " << levelBlocks << " (" << (levelBlocks ? 100.0 * levelDuplicates / levelBlocks : 0.0) << "%)" << std::endl;
     }
   }
 
   return 0;
-}
\ No newline at end of file
+}
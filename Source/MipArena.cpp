@@ -0,0 +1,72 @@
+#include "MipArena.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const size_t levelAlignment = 64;
+
+static size_t PageSize()
+{
+#if defined(_WIN32)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+#else
+  return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+MipArena::MipArena(const std::vector<size_t> & levelSizes) :
+  data(nullptr),
+  size(0),
+  offsets(levelSizes.size()),
+  sizes(levelSizes)
+{
+  for (size_t level = 0; level < levelSizes.size(); level++) {
+    offsets[level] = size;
+    size += (levelSizes[level] + levelAlignment - 1) / levelAlignment * levelAlignment;
+  }
+
+  /* Straight from the OS rather than the heap, so released pages really go back */
+#if defined(_WIN32)
+  data = (uint8_t *)VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  void * mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  data = mapped == MAP_FAILED ? nullptr : (uint8_t *)mapped;
+#endif
+}
+
+MipArena::~MipArena()
+{
+  if (data == nullptr) {
+    return;
+  }
+
+#if defined(_WIN32)
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, size);
+#endif
+}
+
+void MipArena::Release(uint32_t level)
+{
+  static const size_t pageSize = PageSize();
+
+  size_t first = (offsets[level] + pageSize - 1) / pageSize * pageSize;
+  size_t last = (offsets[level] + sizes[level]) / pageSize * pageSize;
+  if (first >= last) {
+    return;
+  }
+
+#if defined(_WIN32)
+  DiscardVirtualMemory(data + first, last - first);
+#else
+  madvise(data + first, last - first, MADV_DONTNEED);
+#endif
+}
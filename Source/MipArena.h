@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/* A whole padded mip chain in one page aligned allocation, every level 64
+   byte aligned. A level's pages can be handed back to the OS as soon as
+   nothing reads it any more, and the arena reused for the next input, which
+   faults them back in on first write. */
+class MipArena
+{
+public:
+  explicit MipArena(const std::vector<size_t> & levelSizes);
+  ~MipArena();
+
+  MipArena(const MipArena &) = delete;
+  MipArena & operator=(const MipArena &) = delete;
+
+  bool Valid() const { return data != nullptr; }
+  uint8_t * Level(uint32_t level) { return data + offsets[level]; }
+
+  /* Drops the physical pages lying wholly inside a level, the contents are
+     undefined afterwards. */
+  void Release(uint32_t level);
+
+private:
+  uint8_t * data;
+  size_t size;
+  std::vector<size_t> offsets;
+  std::vector<size_t> sizes;
+};
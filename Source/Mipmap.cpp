@@ -0,0 +1,189 @@
+#include "Mipmap.h"
+#include <algorithm>
+#include <cmath>
+#include "stb_image_resize.h"
+#include "HalfFloat.h"
+#include "mipmap_ispc.h"
+
+bool ParseMipFilter(const std::string & name, MipFilter & filter)
+{
+  if (name == "box") {
+    filter = MipFilter::Box;
+  } else if (name == "triangle") {
+    filter = MipFilter::Triangle;
+  } else if (name == "kaiser") {
+    filter = MipFilter::Kaiser;
+  } else if (name == "mitchell") {
+    filter = MipFilter::Mitchell;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* Zeroth order modified Bessel function of the first kind, for the Kaiser window */
+static double BesselI0(double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+MipGenerator::MipGenerator(MipFilter filter, bool srgb, bool hdr) :
+  filter(filter),
+  srgb(srgb),
+  hdr(hdr)
+{
+  /* Taps sit at input pixel centres -n/2 + 0.5 ... n/2 - 0.5 from the output
+     pixel centre. Box is 2 taps, triangle the 4 tap tent, and Kaiser an 8 tap
+     windowed sinc (alpha 4, width 2 output pixels). */
+  if (filter == MipFilter::Box) {
+    weights = {0.5f, 0.5f};
+  } else if (filter == MipFilter::Triangle) {
+    weights = {0.125f, 0.375f, 0.375f, 0.125f};
+  } else if (filter == MipFilter::Kaiser) {
+    const double pi = 3.14159265358979323846;
+    const double alpha = 4.0;
+    const double width = 2.0;
+    double sum = 0.0;
+    for (int k = 0; k < 8; k++) {
+      double t = (k - 3.5) / 2.0;
+      double sinc = std::sin(pi * t) / (pi * t);
+      double window = BesselI0(alpha * std::sqrt(1.0 - (t / width) * (t / width))) / BesselI0(alpha);
+      weights.push_back((float)(sinc * window));
+      sum += sinc * window;
+    }
+    for (auto & weight : weights) {
+      weight = (float)(weight / sum);
+    }
+  }
+
+  if (srgb) {
+    srgbToLinear.resize(256);
+    for (int i = 0; i < 256; i++) {
+      float c = i / 255.0f;
+      srgbToLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    linearToSrgb.resize(4096);
+    for (int i = 0; i < 4096; i++) {
+      float c = i / 4095.0f;
+      float s = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+      linearToSrgb[i] = (uint8_t)(s * 255.0f + 0.5f);
+    }
+  }
+}
+
+bool MipGenerator::CanHalve(int srcWidth, int srcHeight) const
+{
+  if (filter == MipFilter::Mitchell) {
+    return false;
+  }
+
+  return (srcWidth % 2 == 0 || srcWidth == 1) && (srcHeight % 2 == 0 || srcHeight == 1);
+}
+
+void MipGenerator::Halve(const rgba_surface & src, int srcWidth, int srcHeight, const rgba_surface & dst, int dstWidth, int firstRow, int rows, bool alpha) const
+{
+  ispc::downsample_filter taps;
+  int count = (int)weights.size();
+
+  taps.step_x = srcWidth == 1 ? 1 : 2;
+  taps.taps_x = srcWidth == 1 ? 1 : count;
+  taps.first_x = srcWidth == 1 ? 0 : 1 - count / 2;
+  taps.step_y = srcHeight == 1 ? 1 : 2;
+  taps.taps_y = srcHeight == 1 ? 1 : count;
+  taps.first_y = srcHeight == 1 ? 0 : 1 - count / 2;
+
+  for (int k = 0; k < count; k++) {
+    taps.weights_x[k] = srcWidth == 1 ? 1.0f : weights[k];
+    taps.weights_y[k] = srcHeight == 1 ? 1.0f : weights[k];
+  }
+
+  thread_local std::vector<float> scratch;
+  scratch.resize(srcWidth * 4);
+
+  /* Row tables for the source rows the band reads and the rows it writes */
+  int srcFirst = std::max(0, firstRow * taps.step_y + taps.first_y);
+  int srcLast = std::min(srcHeight - 1, (firstRow + rows - 1) * taps.step_y + taps.first_y + taps.taps_y - 1);
+
+  thread_local std::vector<uint8_t *> srcRows;
+  thread_local std::vector<uint8_t *> dstRows;
+  srcRows.resize(srcLast - srcFirst + 1);
+  dstRows.resize(rows);
+
+  for (int y = srcFirst; y <= srcLast; y++) {
+    srcRows[y - srcFirst] = src.ptr + (y % src.height) * src.stride;
+  }
+
+  for (int y = firstRow; y < firstRow + rows; y++) {
+    dstRows[y - firstRow] = dst.ptr + (y % dst.height) * dst.stride;
+  }
+
+  if (hdr) {
+    ispc::DownsampleRGBA16F_ispc(srcRows.data(), srcFirst, srcWidth, srcHeight, dstRows.data(), dstWidth, firstRow, rows, &taps, scratch.data(), alpha);
+  } else {
+    ispc::DownsampleRGBA8_ispc(srcRows.data(), srcFirst, srcWidth, srcHeight, dstRows.data(), dstWidth, firstRow, rows, &taps, scratch.data(), srgb, alpha, (float *)srgbToLinear.data(), (uint8_t *)linearToSrgb.data());
+  }
+}
+
+int MipGenerator::HalvedRowsAvailable(int srcHeight, int dstHeight, int srcRows) const
+{
+  if (srcRows >= srcHeight) {
+    return dstHeight;
+  }
+
+  /* Output row y reads up to source row 2y + taps / 2 */
+  int last = srcRows - 1 - (int)weights.size() / 2;
+  if (last < 0) {
+    return 0;
+  }
+  return std::min(dstHeight, last / 2 + 1);
+}
+
+bool MipGenerator::Resize(const rgba_surface & src, int srcWidth, int srcHeight, const rgba_surface & dst, int dstWidth, int dstHeight, bool alpha) const
+{
+  /* stb_image_resize has no Kaiser filter, Catmull-Rom is the closest
+     in sharpness */
+  stbir_filter stbirFilter = STBIR_FILTER_MITCHELL;
+  if (filter == MipFilter::Box) {
+    stbirFilter = STBIR_FILTER_BOX;
+  } else if (filter == MipFilter::Triangle) {
+    stbirFilter = STBIR_FILTER_TRIANGLE;
+  } else if (filter == MipFilter::Kaiser) {
+    stbirFilter = STBIR_FILTER_CATMULLROM;
+  }
+
+  stbir_colorspace colorspace = srgb ? STBIR_COLORSPACE_SRGB : STBIR_COLORSPACE_LINEAR;
+  int alphaChannel = alpha ? 3 : STBIR_ALPHA_CHANNEL_NONE;
+
+  int rv;
+  if (hdr) {
+    std::vector<float> srcFloat(srcWidth * srcHeight * 4);
+    std::vector<float> dstFloat(dstWidth * dstHeight * 4);
+
+    for (int y = 0; y < srcHeight; y++) {
+      const uint16_t * row = (const uint16_t *)(src.ptr + y * src.stride);
+      for (int x = 0; x < srcWidth * 4; x++) {
+        srcFloat[y * srcWidth * 4 + x] = HalfFloat::ToFloat(row[x]);
+      }
+    }
+
+    rv = stbir_resize_float_generic(srcFloat.data(), srcWidth, srcHeight, 0, dstFloat.data(), dstWidth, dstHeight, 0, 4, alphaChannel, 0, STBIR_EDGE_CLAMP, stbirFilter, colorspace, nullptr);
+
+    for (int y = 0; y < dstHeight; y++) {
+      uint16_t * row = (uint16_t *)(dst.ptr + y * dst.stride);
+      for (int x = 0; x < dstWidth * 4; x++) {
+        row[x] = HalfFloat::FromFloat(std::min(std::max(dstFloat[y * dstWidth * 4 + x], 0.0f), 65504.0f));
+      }
+    }
+  } else {
+    rv = stbir_resize_uint8_generic(src.ptr, srcWidth, srcHeight, src.stride, dst.ptr, dstWidth, dstHeight, dst.stride, 4, alphaChannel, 0, STBIR_EDGE_CLAMP, stbirFilter, colorspace, nullptr);
+  }
+
+  return rv == 1;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "ispc_texcomp/ispc_texcomp.h"
+
+enum class MipFilter
+{
+  Box,
+  Triangle,
+  Kaiser,
+  Mitchell
+};
+
+bool ParseMipFilter(const std::string & name, MipFilter & filter);
+
+/* Builds mip levels. Halving an axis that is even (or already 1 pixel) goes
+   through the ISPC kernel in mipmap.ispc a band of rows at a time, anything
+   else is resized as a whole by stb_image_resize. */
+class MipGenerator
+{
+public:
+  MipGenerator(MipFilter filter, bool srgb, bool hdr);
+
+  bool CanHalve(int srcWidth, int srcHeight) const;
+
+  /* Writes rows [firstRow, firstRow + rows) of the level below src into dst.
+     Surfaces are RGBA8, or RGBA16F for HDR. Row y of a surface is stored at
+     y modulo its height, so a ring of rows can stand in for a whole level.
+     Odd sizes are accepted, the destination size is rounded down and the
+     filter keeps its footprint, so the last source row/column only reaches
+     the output through the outer taps of the triangle and Kaiser filters,
+     and is dropped entirely by the 2 tap box filter. */
+  void Halve(const rgba_surface & src, int srcWidth, int srcHeight, const rgba_surface & dst, int dstWidth, int firstRow, int rows, bool alpha) const;
+
+  /* Number of rows of the halved level that can be built once the first
+     srcRows rows of the source level are available. */
+  int HalvedRowsAvailable(int srcHeight, int dstHeight, int srcRows) const;
+
+  /* Generic resize of the whole level with stb_image_resize. HDR levels go
+     through float copies, stb_image_resize has no half float type. */
+  bool Resize(const rgba_surface & src, int srcWidth, int srcHeight, const rgba_surface & dst, int dstWidth, int dstHeight, bool alpha) const;
+
+private:
+  MipFilter filter;
+  bool srgb;
+  bool hdr;
+
+  std::vector<float> weights;
+  std::vector<float> srgbToLinear;
+  std::vector<uint8_t> linearToSrgb;
+};
@@ -0,0 +1,95 @@
+#include "Progress.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include "ThreadPool.h"
+
+Progress::Progress(size_t total, unsigned int workers, bool enabled) :
+  total(total),
+  slots(workers + 1),
+  counters(new Counter[workers + 1]),
+  enabled(enabled),
+  stop(false)
+{
+  for (unsigned int i = 0; i < slots; i++) {
+    counters[i].value = 0;
+  }
+
+  if (enabled) {
+    reporter = std::thread(&Progress::Report, this);
+  }
+}
+
+Progress::~Progress()
+{
+  Finish();
+}
+
+void Progress::Add(size_t amount)
+{
+  /* Workers each own a counter, anything off the pool shares the last one */
+  int index = ThreadPool::WorkerIndex();
+  if (index < 0 || index >= (int)slots - 1) {
+    index = slots - 1;
+  }
+
+  counters[index].value.fetch_add(amount, std::memory_order_relaxed);
+}
+
+size_t Progress::Completed() const
+{
+  size_t completed = 0;
+  for (unsigned int i = 0; i < slots; i++) {
+    completed += counters[i].value.load(std::memory_order_relaxed);
+  }
+  return completed;
+}
+
+void Progress::Finish()
+{
+  if (!reporter.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  reporter.join();
+
+  Draw(total);
+  std::cout << std::endl;
+}
+
+void Progress::Report()
+{
+  size_t drawn = (size_t)-1;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stop) {
+    size_t completed = Completed();
+    if (completed != drawn) {
+      Draw(completed);
+      drawn = completed;
+    }
+
+    wake.wait_for(lock, std::chrono::milliseconds(100), [&](){ return stop; });
+  }
+}
+
+void Progress::Draw(size_t completed)
+{
+  float progress = total > 0 ? (float)completed / total : 1.0f;
+  int barWidth = 70;
+
+  std::cout << "[";
+  int pos = (int)(barWidth * progress);
+  for (int i = 0; i < barWidth; ++i) {
+      if (i < pos) std::cout << "=";
+      else if (i == pos) std::cout << ">";
+      else std::cout << " ";
+  }
+  std::cout << "] " << std::setw(2) << int(progress * 100.0) << " %\r";
+  std::cout.flush();
+}
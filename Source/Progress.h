@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/* Progress bar fed by one relaxed counter per pool worker. A reporter thread
+   sums the counters a few times a second and redraws the bar, so workers
+   never take a lock or touch std::cout. */
+class Progress
+{
+public:
+  Progress(size_t total, unsigned int workers, bool enabled);
+  ~Progress();
+
+  Progress(const Progress &) = delete;
+  Progress & operator=(const Progress &) = delete;
+
+  /* Adds completed work for the calling thread. */
+  void Add(size_t amount);
+
+  size_t Completed() const;
+
+  /* Stops the reporter and draws the final bar. */
+  void Finish();
+
+private:
+  struct alignas(64) Counter
+  {
+    std::atomic<size_t> value;
+  };
+
+  void Report();
+  void Draw(size_t completed);
+
+  size_t total;
+  unsigned int slots;
+  std::unique_ptr<Counter[]> counters;
+  bool enabled;
+
+  bool stop;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::thread reporter;
+};
@@ -0,0 +1,114 @@
+#include "Streaming.h"
+#include <algorithm>
+
+/* Rows kept per level. Enough for the rows still being compressed from the
+   last band, the rows being written for this one and the filter's reach into
+   the level above, with some to spare. A multiple of 4 so block rows never
+   wrap. */
+static const int ringRows = 64;
+
+StreamEncoder::StreamEncoder(const std::vector<std::unique_ptr<Compressor>> & compressors, const MipGenerator & mipGenerator, Ktx2Writer & writer, ThreadPool & pool, Progress & progress,
+                             const std::vector<int> & levelWidths, const std::vector<int> & levelHeights, bool hdr, unsigned int stripBlockRows) :
+  compressors(compressors),
+  mipGenerator(mipGenerator),
+  writer(writer),
+  pool(pool),
+  progress(progress),
+  levelWidths(levelWidths),
+  levelHeights(levelHeights),
+  hdr(hdr),
+  stripBlockRows(stripBlockRows),
+  rings(levelWidths.size())
+{
+  std::vector<size_t> ringBytes(levelWidths.size());
+  for (size_t l = 0; l < levelWidths.size(); l++) {
+    unsigned int blocksWidth = (levelWidths[l] + 3) / 4;
+    unsigned int blocksHeight = (levelHeights[l] + 3) / 4;
+
+    rings[l].width = blocksWidth * 4;
+    rings[l].height = std::min(ringRows, (int)blocksHeight * 4);
+    rings[l].stride = blocksWidth * 4 * 4 * (hdr ? sizeof(uint16_t) : 1);
+    ringBytes[l] = rings[l].height * rings[l].stride;
+  }
+
+  arena = std::make_unique<MipArena>(ringBytes);
+  for (size_t l = 0; l < levelWidths.size(); l++) {
+    rings[l].ptr = arena->Level(l);
+  }
+}
+
+void StreamEncoder::CompressRows(uint32_t level, int input, unsigned int firstBlockRow, unsigned int lastBlockRow)
+{
+  unsigned int blocksWidth = rings[level].width / 4;
+  unsigned int ringBlockRows = rings[level].height / 4;
+  int bpp = hdr ? 4 * sizeof(uint16_t) * 8 : 4 * 8;
+  size_t blockSize = compressors[level]->BlockSize();
+
+  /* Split where the ring wraps, so each band is contiguous */
+  while (firstBlockRow < lastBlockRow) {
+    unsigned int end = std::min(lastBlockRow, (firstBlockRow / ringBlockRows + 1) * ringBlockRows);
+
+    rgba_surface band = rings[level];
+    band.ptr = Row(level, firstBlockRow * 4);
+    band.height = (end - firstBlockRow) * 4;
+    PadToBlocks(band, levelWidths[level], std::min(levelHeights[level], (int)end * 4) - (int)firstBlockRow * 4, bpp);
+
+    for (unsigned int row = firstBlockRow; row < end; row += stripBlockRows) {
+      unsigned int rows = std::min(stripBlockRows, end - row);
+      uint8_t * dst = writer.Image(level, input) + row * blocksWidth * blockSize;
+
+      pool.Submit([this, level, band, row, rows, firstBlockRow, blocksWidth, dst](){
+        compressors[level]->CompressStrip(band, row - firstBlockRow, rows, dst);
+        progress.Add(rows * blocksWidth);
+      });
+    }
+
+    firstBlockRow = end;
+  }
+}
+
+bool StreamEncoder::Encode(BandReader & reader, int input, bool alpha)
+{
+  uint32_t levelCount = levelWidths.size();
+  std::vector<int> produced(levelCount, 0);
+  std::vector<unsigned int> compressed(levelCount, 0);
+  int bandRows = stripBlockRows * 4;
+  bool ok = true;
+
+  /* Each band is read and downsampled while the previous band's tiles are
+     compressed on the pool */
+  while (produced[0] < levelHeights[0]) {
+    int rows = std::min(bandRows, levelHeights[0] - produced[0]);
+    for (int y = produced[0]; y < produced[0] + rows; y++) {
+      if (!reader.ReadRow(Row(0, y))) {
+        ok = false;
+        break;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+    produced[0] += rows;
+
+    for (uint32_t l = 1; l < levelCount; l++) {
+      int available = mipGenerator.HalvedRowsAvailable(levelHeights[l - 1], levelHeights[l], produced[l - 1]);
+      if (available > produced[l]) {
+        mipGenerator.Halve(rings[l - 1], levelWidths[l - 1], levelHeights[l - 1], rings[l], levelWidths[l], produced[l], available - produced[l], alpha);
+        produced[l] = available;
+      }
+    }
+
+    pool.Wait();
+
+    for (uint32_t l = 0; l < levelCount; l++) {
+      unsigned int ready = produced[l] == levelHeights[l] ? (levelHeights[l] + 3) / 4 : produced[l] / 4;
+      if (ready > compressed[l]) {
+        CompressRows(l, input, compressed[l], ready);
+        compressed[l] = ready;
+      }
+    }
+  }
+
+  pool.Wait();
+  return ok;
+}
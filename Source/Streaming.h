@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "BandReader.h"
+#include "Compressor.h"
+#include "Ktx2Writer.h"
+#include "MipArena.h"
+#include "Mipmap.h"
+#include "Progress.h"
+#include "ThreadPool.h"
+
+/* Compresses inputs too large to hold in memory. The source is read a band
+   of rows at a time into a ring of rows per level, each level is halved from
+   the one above as soon as enough rows exist, and each completed band of
+   block rows is compressed straight into the writer. Memory depends on the
+   width of the image, not its area. */
+class StreamEncoder
+{
+public:
+  StreamEncoder(const std::vector<std::unique_ptr<Compressor>> & compressors, const MipGenerator & mipGenerator, Ktx2Writer & writer, ThreadPool & pool, Progress & progress,
+                const std::vector<int> & levelWidths, const std::vector<int> & levelHeights, bool hdr, unsigned int stripBlockRows);
+
+  bool Valid() const { return arena->Valid(); }
+
+  /* Streams one input into image index input of every level */
+  bool Encode(BandReader & reader, int input, bool alpha);
+
+private:
+  uint8_t * Row(uint32_t level, int y) { return rings[level].ptr + (y % rings[level].height) * rings[level].stride; }
+  void CompressRows(uint32_t level, int input, unsigned int firstBlockRow, unsigned int lastBlockRow);
+
+  const std::vector<std::unique_ptr<Compressor>> & compressors;
+  const MipGenerator & mipGenerator;
+  Ktx2Writer & writer;
+  ThreadPool & pool;
+  Progress & progress;
+  std::vector<int> levelWidths;
+  std::vector<int> levelHeights;
+  bool hdr;
+  unsigned int stripBlockRows;
+
+  std::unique_ptr<MipArena> arena;
+  std::vector<rgba_surface> rings;
+};
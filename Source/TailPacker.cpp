@@ -0,0 +1,85 @@
+#include "TailPacker.h"
+#include <algorithm>
+#include <cstring>
+
+TailPacker::TailPacker(int blockWidth, int blockHeight, size_t texelBytes, size_t blockSize, unsigned int batchBlocks) :
+  blockWidth(blockWidth),
+  blockHeight(blockHeight),
+  texelBytes(texelBytes),
+  blockSize(blockSize),
+  batchBlocks(batchBlocks)
+{
+}
+
+void TailPacker::Add(int group, const rgba_surface & level, uint8_t * dst, int image, std::vector<Batch> & full)
+{
+  size_t rowSize = texelBytes / blockHeight;
+  size_t stride = batchBlocks * rowSize;
+  unsigned int blocksWidth = level.width / blockWidth;
+  unsigned int blockCount = blocksWidth * (level.height / blockHeight);
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto batch = std::find_if(pending.begin(), pending.end(), [&](const Batch & batch){ return batch.group == group; });
+  if (batch == pending.end()) {
+    pending.push_back(Batch());
+    batch = pending.end() - 1;
+    batch->group = group;
+    batch->blocks = 0;
+  }
+
+  for (unsigned int block = 0; block < blockCount; block++) {
+    if (batch->blocks == 0) {
+      batch->texels.resize(blockHeight * stride);
+    }
+
+    /* A level can straddle two batches, so each batch starts a new segment */
+    if (block == 0 || batch->segments.empty()) {
+      batch->segments.push_back({dst + block * blockSize, 0, image});
+    }
+
+    const uint8_t * texels = level.ptr + (block / blocksWidth) * blockHeight * level.stride + (block % blocksWidth) * rowSize;
+    for (int y = 0; y < blockHeight; y++) {
+      memcpy(batch->texels.data() + y * stride + batch->blocks * rowSize, texels + y * level.stride, rowSize);
+    }
+    batch->segments.back().blocks++;
+
+    if (++batch->blocks == batchBlocks) {
+      full.push_back(std::move(*batch));
+      *batch = Batch();
+      batch->group = group;
+      batch->blocks = 0;
+    }
+  }
+}
+
+void TailPacker::Flush(std::vector<Batch> & batches)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+
+  for (auto & batch : pending) {
+    if (batch.blocks > 0) {
+      batches.push_back(std::move(batch));
+    }
+  }
+  pending.clear();
+}
+
+void TailPacker::Compress(const Compressor & compressor, const Batch & batch) const
+{
+  rgba_surface surface;
+  surface.ptr = (uint8_t *)batch.texels.data();
+  surface.width = batch.blocks * blockWidth;
+  surface.height = blockHeight;
+  surface.stride = (int)(batchBlocks * texelBytes / blockHeight);
+
+  thread_local std::vector<uint8_t> compressed;
+  compressed.resize(batch.blocks * blockSize);
+  compressor.CompressStrip(surface, 0, 1, compressed.data());
+
+  size_t offset = 0;
+  for (auto & segment : batch.segments) {
+    memcpy(segment.dst, compressed.data() + offset, segment.blocks * blockSize);
+    offset += segment.blocks * blockSize;
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include "Compressor.h"
+
+/* Levels below 64x64 have fewer blocks than there are lanes over all the
+   threads, and compressed a row of blocks at a time most of each gang sits
+   idle. The blocks of those levels, from every level, input and face, are
+   copied into shared batches one block high instead, which are compressed
+   in full gangs and scattered back to their images. */
+class TailPacker
+{
+public:
+  /* texelBytes is the size of one block's RGBA texels */
+  TailPacker(int blockWidth, int blockHeight, size_t texelBytes, size_t blockSize, unsigned int batchBlocks);
+
+  TailPacker(const TailPacker &) = delete;
+  TailPacker & operator=(const TailPacker &) = delete;
+
+  /* A run of a batch's blocks going to consecutive blocks of one image */
+  struct Segment
+  {
+    uint8_t * dst;
+    unsigned int blocks;
+    int image;
+  };
+
+  struct Batch
+  {
+    int group;
+    unsigned int blocks;
+    std::vector<uint8_t> texels;
+    std::vector<Segment> segments;
+  };
+
+  unsigned int BatchBlocks() const { return batchBlocks; }
+
+  /* Copies every block of a padded level into the pending batch of group,
+     only levels sharing a compressor may share a group. Batches that fill
+     up are appended to full, for the caller to compress. */
+  void Add(int group, const rgba_surface & level, uint8_t * dst, int image, std::vector<Batch> & full);
+
+  /* Hands over the batches that are still partly filled */
+  void Flush(std::vector<Batch> & batches);
+
+  /* Compresses a batch and copies the blocks to their images */
+  void Compress(const Compressor & compressor, const Batch & batch) const;
+
+private:
+  int blockWidth;
+  int blockHeight;
+  size_t texelBytes;
+  size_t blockSize;
+  unsigned int batchBlocks;
+
+  std::mutex mutex;
+  std::vector<Batch> pending;
+};
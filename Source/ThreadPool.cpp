@@ -0,0 +1,123 @@
+#include "ThreadPool.h"
+
+static thread_local ThreadPool * currentPool = nullptr;
+static thread_local int workerIndex = -1;
+
+ThreadPool::ThreadPool(unsigned int numThreads) :
+  queued(0),
+  pending(0),
+  nextQueue(0),
+  stop(false)
+{
+  if (numThreads == 0) {
+    numThreads = 1;
+  }
+
+  for (unsigned int i = 0; i < numThreads; i++) {
+    queues.push_back(std::make_unique<Queue>());
+  }
+
+  for (unsigned int i = 0; i < numThreads; i++) {
+    workers.push_back(std::thread(&ThreadPool::Run, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stop = true;
+  }
+  wake.notify_all();
+
+  for (auto & worker : workers) {
+    worker.join();
+  }
+}
+
+int ThreadPool::WorkerIndex()
+{
+  return workerIndex;
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+  unsigned int index;
+  if (currentPool == this) {
+    index = workerIndex;
+  } else {
+    index = nextQueue++ % queues.size();
+  }
+
+  pending++;
+  queued++;
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    queues[index]->tasks.push_back(std::move(task));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+  }
+  wake.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+  std::unique_lock<std::mutex> lock(sleepMutex);
+  done.wait(lock, [&](){ return pending == 0; });
+}
+
+bool ThreadPool::Pop(unsigned int index, std::function<void()> & task)
+{
+  /* Newest task from our own deque first, it is the most likely to still be in cache */
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    if (!queues[index]->tasks.empty()) {
+      task = std::move(queues[index]->tasks.back());
+      queues[index]->tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+
+  /* Otherwise steal the oldest task from someone else */
+  for (size_t i = 1; i < queues.size(); i++) {
+    Queue & victim = *queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::Run(unsigned int index)
+{
+  currentPool = this;
+  workerIndex = index;
+
+  std::function<void()> task;
+  while (1) {
+    if (Pop(index, task)) {
+      task();
+      task = nullptr;
+
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        done.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    wake.wait(lock, [&](){ return stop || queued > 0; });
+    if (stop && queued == 0) {
+      return;
+    }
+  }
+}
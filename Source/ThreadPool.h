@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Fixed set of worker threads, each with its own task deque. A worker pops
+   its own newest task first and steals the oldest task from another worker
+   when it runs dry, so tasks submitted from inside a task stay local while
+   idle workers balance the load. */
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned int numThreads = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool & operator=(const ThreadPool &) = delete;
+
+  /* Queues a task. From a worker it goes on that worker's deque, otherwise
+     the deques are filled round robin. */
+  void Submit(std::function<void()> task);
+
+  /* Blocks until every submitted task, including those submitted by other
+     tasks, has finished. */
+  void Wait();
+
+  unsigned int Size() const { return (unsigned int)workers.size(); }
+
+  /* Index of the calling worker in [0, Size()), or -1 off the pool. */
+  static int WorkerIndex();
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void Run(unsigned int index);
+  bool Pop(unsigned int index, std::function<void()> & task);
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<Queue>> queues;
+
+  std::atomic<size_t> queued;
+  std::atomic<size_t> pending;
+  std::atomic<unsigned int> nextQueue;
+  bool stop;
+
+  std::mutex sleepMutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+};
@@ -28,39 +28,182 @@
 
 #include "ispc_texcomp.h"
 #include "kernel_ispc.h"
+#include "kernel_astc_ispc.h"
 #include <memory.h> // memcpy
 
+/* kernel.ispc and kernel_astc.ispc are built for several targets. Rather
+   than ISPC's own dispatcher, the target is picked here from the CPU's
+   feature bits, so it can be overridden with ISPCSetIsa. */
+#define DECLARE_KERNELS(isa) \
+  extern int32_t ISPCIsa_ispc_##isa(); \
+  void CompressBlocksBC1_ispc_##isa(const rgba_surface* src, uint8_t* dst); \
+  void CompressBlocksBC3_ispc_##isa(const rgba_surface* src, uint8_t* dst); \
+  void CompressBlocksBC4_ispc_##isa(const rgba_surface* src, uint8_t* dst); \
+  void CompressBlocksBC5_ispc_##isa(const rgba_surface* src, uint8_t* dst); \
+  void CompressBlocksBC6H_ispc_##isa(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings); \
+  void CompressBlocksBC7_ispc_##isa(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings); \
+  void CompressBlocksBC6HError_ispc_##isa(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings, float* errors); \
+  void CompressBlocksBC7Error_ispc_##isa(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings, float* errors); \
+  void CompressBlocksETC1_ispc_##isa(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings); \
+  void CompressBlocksETC2_ispc_##isa(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings); \
+  void CompressBlocksETC2RGBA_ispc_##isa(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings); \
+  void CompressBlocksEACR11_ispc_##isa(const rgba_surface* src, uint8_t* dst); \
+  void CompressBlocksEACRG11_ispc_##isa(const rgba_surface* src, uint8_t* dst); \
+  extern int32_t get_programCount_##isa(); \
+  void astc_rank_ispc_##isa(rgba_surface* src, int32_t xx, int32_t yy, uint32_t* mode_buffer, int32_t* mode_counts, astc_enc_settings* settings); \
+  void astc_encode_ispc_##isa(rgba_surface* src, float* block_scores, uint8_t* dst, uint64_t* list, astc_enc_context* list_context, astc_enc_settings* settings);
+
 namespace ispc {
 extern "C" {
-  extern int32_t ISPCIsa_ispc_sse4();
-  extern "C" void CompressBlocksBC1_ispc_sse4(const rgba_surface* src, uint8_t* dst);
-  extern "C" void CompressBlocksBC3_ispc_sse4(const rgba_surface* src, uint8_t* dst);
-  extern "C" void CompressBlocksBC4_ispc_sse4(const rgba_surface* src, uint8_t* dst);
-  extern "C" void CompressBlocksBC5_ispc_sse4(const rgba_surface* src, uint8_t* dst);
-  extern "C" void CompressBlocksBC6H_ispc_sse4(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings);
-  extern "C" void CompressBlocksBC7_ispc_sse4(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings);
-  extern "C" void CompressBlocksETC1_ispc_sse4(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings);
-  extern "C" void CompressBlocksASTC_ispc_sse4(const rgba_surface* src, uint8_t* dst, astc_enc_settings* settings);
+  DECLARE_KERNELS(sse4)
+  DECLARE_KERNELS(avx2)
+  DECLARE_KERNELS(avx512skx)
+  DECLARE_KERNELS(avx512icl)
 }
 }
 
-static bool isAmd = false;
+struct KernelTable
+{
+  int isa;
+  int32_t (*Isa)();
+  void (*BC1)(const ispc::rgba_surface* src, uint8_t* dst);
+  void (*BC3)(const ispc::rgba_surface* src, uint8_t* dst);
+  void (*BC4)(const ispc::rgba_surface* src, uint8_t* dst);
+  void (*BC5)(const ispc::rgba_surface* src, uint8_t* dst);
+  void (*BC6H)(const ispc::rgba_surface* src, uint8_t* dst, ispc::bc6h_enc_settings* settings);
+  void (*BC7)(const ispc::rgba_surface* src, uint8_t* dst, ispc::bc7_enc_settings* settings);
+  void (*BC6HError)(const ispc::rgba_surface* src, uint8_t* dst, ispc::bc6h_enc_settings* settings, float* errors);
+  void (*BC7Error)(const ispc::rgba_surface* src, uint8_t* dst, ispc::bc7_enc_settings* settings, float* errors);
+  void (*ETC1)(const ispc::rgba_surface* src, uint8_t* dst, ispc::etc_enc_settings* settings);
+  void (*ETC2)(const ispc::rgba_surface* src, uint8_t* dst, ispc::etc_enc_settings* settings);
+  void (*ETC2RGBA)(const ispc::rgba_surface* src, uint8_t* dst, ispc::etc_enc_settings* settings);
+  void (*EACR11)(const ispc::rgba_surface* src, uint8_t* dst);
+  void (*EACRG11)(const ispc::rgba_surface* src, uint8_t* dst);
+  int32_t (*ASTCProgramCount)();
+  void (*ASTCRank)(ispc::rgba_surface* src, int32_t xx, int32_t yy, uint32_t* mode_buffer, int32_t* mode_counts, ispc::astc_enc_settings* settings);
+  void (*ASTCEncode)(ispc::rgba_surface* src, float* block_scores, uint8_t* dst, uint64_t* list, ispc::astc_enc_context* list_context, ispc::astc_enc_settings* settings);
+};
+
+#define KERNEL_TABLE(id, isa) { \
+  id, \
+  ispc::ISPCIsa_ispc_##isa, \
+  ispc::CompressBlocksBC1_ispc_##isa, \
+  ispc::CompressBlocksBC3_ispc_##isa, \
+  ispc::CompressBlocksBC4_ispc_##isa, \
+  ispc::CompressBlocksBC5_ispc_##isa, \
+  ispc::CompressBlocksBC6H_ispc_##isa, \
+  ispc::CompressBlocksBC7_ispc_##isa, \
+  ispc::CompressBlocksBC6HError_ispc_##isa, \
+  ispc::CompressBlocksBC7Error_ispc_##isa, \
+  ispc::CompressBlocksETC1_ispc_##isa, \
+  ispc::CompressBlocksETC2_ispc_##isa, \
+  ispc::CompressBlocksETC2RGBA_ispc_##isa, \
+  ispc::CompressBlocksEACR11_ispc_##isa, \
+  ispc::CompressBlocksEACRG11_ispc_##isa, \
+  ispc::get_programCount_##isa, \
+  ispc::astc_rank_ispc_##isa, \
+  ispc::astc_encode_ispc_##isa }
+
+static const KernelTable kernelTables[] = {
+  KERNEL_TABLE(ISPC_ISA_SSE4, sse4),
+  KERNEL_TABLE(ISPC_ISA_AVX2, avx2),
+  KERNEL_TABLE(ISPC_ISA_AVX512SKX, avx512skx),
+  KERNEL_TABLE(ISPC_ISA_AVX512ICL, avx512icl)
+};
+
+static const KernelTable* kernels = &kernelTables[0];
+static int supportedIsa = ISPC_ISA_SSE4;
+
+void ISPCCpuId(int leaf, int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+  __cpuidex((int*)regs, leaf, subleaf);
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
 
-void ISPCInit()
+static unsigned long long XGetBv()
 {
 #if defined(_MSC_VER)
+  return _xgetbv(0);
+#else
+  unsigned int eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+/* Best target the CPU and OS support, from the CPUID feature bits. AVX needs
+   the OS to save the YMM state and AVX-512 the opmask and ZMM state too. */
+static int DetectIsa()
 {
-  int CPUInfo[4];
-  __cpuid(CPUInfo, 0x80000001);
-  isAmd = (CPUInfo[2] & (1 << 6)) != 0;
+  unsigned int regs[4];
+  ISPCCpuId(0, 0, regs);
+  unsigned int maxLeaf = regs[0];
+
+  ISPCCpuId(1, 0, regs);
+  unsigned int ecx1 = regs[2];
+  bool osxsave = (ecx1 & (1 << 27)) != 0;
+  bool avx = (ecx1 & (1 << 28)) != 0;
+  bool fma = (ecx1 & (1 << 12)) != 0;
+  bool f16c = (ecx1 & (1 << 29)) != 0;
+
+  unsigned long long xcr0 = osxsave ? XGetBv() : 0;
+  bool ymmState = (xcr0 & 0x6) == 0x6;
+  bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+  unsigned int ebx7 = 0, ecx7 = 0;
+  if (maxLeaf >= 7) {
+    ISPCCpuId(7, 0, regs);
+    ebx7 = regs[1];
+    ecx7 = regs[2];
+  }
+
+  bool avx2 = avx && fma && f16c && ymmState && (ebx7 & (1 << 5)) && (ebx7 & (1 << 3)) && (ebx7 & (1 << 8));
+
+  /* F, DQ, CD, BW and VL */
+  const unsigned int skxBits = (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31);
+  bool avx512skx = avx2 && zmmState && (ebx7 & skxBits) == skxBits;
+
+  /* IFMA, and VBMI, VBMI2, GFNI, VAES, VPCLMULQDQ, VNNI, BITALG and VPOPCNTDQ */
+  const unsigned int iclBits = (1u << 1) | (1u << 6) | (1u << 8) | (1u << 9) | (1u << 10) | (1u << 11) | (1u << 12) | (1u << 14);
+  bool avx512icl = avx512skx && (ebx7 & (1u << 21)) && (ecx7 & iclBits) == iclBits;
+
+  if (avx512icl) {
+    return ISPC_ISA_AVX512ICL;
+  } else if (avx512skx) {
+    return ISPC_ISA_AVX512SKX;
+  } else if (avx2) {
+    return ISPC_ISA_AVX2;
+  }
+  return ISPC_ISA_SSE4;
 }
-#else
+
+void ISPCInit()
+{
+  supportedIsa = DetectIsa();
+  ISPCSetIsa(supportedIsa);
+}
+
+bool ISPCSetIsa(int isa)
 {
-  unsigned int eax, ebx, ecx, edx;
-  __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
-  isAmd = (ecx & (1 << 6)) != 0;
+  if (isa > supportedIsa) {
+    return false;
+  }
+
+  for (const KernelTable& table : kernelTables) {
+    if (table.isa == isa) {
+      kernels = &table;
+      return true;
+    }
+  }
+  return false;
 }
-#endif 
+
+int ISPCSupportedIsa()
+{
+  return supportedIsa;
 }
 
 void GetProfile_ultrafast(bc7_enc_settings* settings)
@@ -455,9 +598,25 @@ void GetProfile_bc6h_veryslow(bc6h_enc_settings* settings)
     settings->refineIterations_2p = 2;
 }
 
+void GetProfile_etc_ultrafast(etc_enc_settings* settings)
+{
+    settings->fast_mode = true;
+    settings->fastSkipTreshold = 1;
+    settings->refineIterations = 0;
+}
+
+void GetProfile_etc_fast(etc_enc_settings* settings)
+{
+    settings->fast_mode = true;
+    settings->fastSkipTreshold = 1;
+    settings->refineIterations = 2;
+}
+
 void GetProfile_etc_slow(etc_enc_settings* settings)
 {
+    settings->fast_mode = false;
     settings->fastSkipTreshold = 6;
+    settings->refineIterations = 0;
 }
 
 void ReplicateBorders(rgba_surface* dst_slice, const rgba_surface* src_tex, int start_x, int start_y, int bpp)
@@ -487,72 +646,86 @@ void ReplicateBorders(rgba_surface* dst_slice, const rgba_surface* src_tex, int
 
 void CompressBlocksBC1(const rgba_surface* src, uint8_t* dst)
 {
-  if (isAmd) {
-    ispc::CompressBlocksBC1_ispc_sse4((ispc::rgba_surface*)src, dst);  
-  } else {
-    ispc::CompressBlocksBC1_ispc((ispc::rgba_surface*)src, dst);
-  }
+  kernels->BC1((ispc::rgba_surface*)src, dst);
 }
 
 void CompressBlocksBC3(const rgba_surface* src, uint8_t* dst)
 {
-  if (isAmd) {
-    ispc::CompressBlocksBC3_ispc_sse4((ispc::rgba_surface*)src, dst);  
-  } else {
-	  ispc::CompressBlocksBC3_ispc((ispc::rgba_surface*)src, dst);
-  }
+  kernels->BC3((ispc::rgba_surface*)src, dst);
 }
 
 void CompressBlocksBC4(const rgba_surface* src, uint8_t* dst)
 {
-  if (isAmd) {
-    ispc::CompressBlocksBC4_ispc_sse4((ispc::rgba_surface*)src, dst);  
-  } else {
-	  ispc::CompressBlocksBC4_ispc((ispc::rgba_surface*)src, dst);
-  }
+  kernels->BC4((ispc::rgba_surface*)src, dst);
 }
 
 void CompressBlocksBC5(const rgba_surface* src, uint8_t* dst)
 {
-  if (isAmd) {
-    ispc::CompressBlocksBC5_ispc_sse4((ispc::rgba_surface*)src, dst);  
-  } else {
-    ispc::CompressBlocksBC5_ispc((ispc::rgba_surface*)src, dst);
-  }
+  kernels->BC5((ispc::rgba_surface*)src, dst);
 }
 
 void CompressBlocksBC7(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings)
 {
-  if (isAmd) {
-    ispc::CompressBlocksBC7_ispc_sse4((ispc::rgba_surface*)src, dst, (ispc::bc7_enc_settings*)settings);  
-  } else {
-    ispc::CompressBlocksBC7_ispc((ispc::rgba_surface*)src, dst, (ispc::bc7_enc_settings*)settings);
-  }
+  kernels->BC7((ispc::rgba_surface*)src, dst, (ispc::bc7_enc_settings*)settings);
 }
 
 void CompressBlocksBC6H(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings)
 {
-  if (isAmd) {
-    ispc::CompressBlocksBC6H_ispc_sse4((ispc::rgba_surface*)src, dst, (ispc::bc6h_enc_settings*)settings);
-  } else {
-    ispc::CompressBlocksBC6H_ispc((ispc::rgba_surface*)src, dst, (ispc::bc6h_enc_settings*)settings);
-  }
+  kernels->BC6H((ispc::rgba_surface*)src, dst, (ispc::bc6h_enc_settings*)settings);
+}
+
+void CompressBlocksBC7Error(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings, float* errors)
+{
+  kernels->BC7Error((ispc::rgba_surface*)src, dst, (ispc::bc7_enc_settings*)settings, errors);
+}
+
+void CompressBlocksBC6HError(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings, float* errors)
+{
+  kernels->BC6HError((ispc::rgba_surface*)src, dst, (ispc::bc6h_enc_settings*)settings, errors);
 }
 
 void CompressBlocksETC1(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings)
 {
-  if (isAmd) {
-    ispc::CompressBlocksETC1_ispc_sse4((ispc::rgba_surface*)src, dst, (ispc::etc_enc_settings*)settings);
-  } else {
-    ispc::CompressBlocksETC1_ispc((ispc::rgba_surface*)src, dst, (ispc::etc_enc_settings*)settings);
-  }
+  kernels->ETC1((ispc::rgba_surface*)src, dst, (ispc::etc_enc_settings*)settings);
+}
+
+void CompressBlocksETC2(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings)
+{
+  kernels->ETC2((ispc::rgba_surface*)src, dst, (ispc::etc_enc_settings*)settings);
+}
+
+void CompressBlocksETC2RGBA(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings)
+{
+  kernels->ETC2RGBA((ispc::rgba_surface*)src, dst, (ispc::etc_enc_settings*)settings);
+}
+
+void CompressBlocksEACR11(const rgba_surface* src, uint8_t* dst)
+{
+  kernels->EACR11((ispc::rgba_surface*)src, dst);
+}
+
+void CompressBlocksEACRG11(const rgba_surface* src, uint8_t* dst)
+{
+  kernels->EACRG11((ispc::rgba_surface*)src, dst);
+}
+
+/* The ASTC kernels are driven from ispc_texcomp_astc.cpp */
+int ASTCProgramCount()
+{
+  return kernels->ASTCProgramCount();
+}
+
+void ASTCRank(ispc::rgba_surface* src, int xx, int yy, uint32_t* mode_buffer, int32_t* mode_counts, ispc::astc_enc_settings* settings)
+{
+  kernels->ASTCRank(src, xx, yy, mode_buffer, mode_counts, settings);
+}
+
+void ASTCEncode(ispc::rgba_surface* src, float* block_scores, uint8_t* dst, uint64_t* list, ispc::astc_enc_context* list_context, ispc::astc_enc_settings* settings)
+{
+  kernels->ASTCEncode(src, block_scores, dst, list, list_context, settings);
 }
 
 int ISPCIsa()
 {
-  if (isAmd) {
-    return ispc::ISPCIsa_ispc_sse4();
-  } else {
-    return ispc::ISPCIsa_ispc();
-  }
+  return kernels->Isa();
 }
\ No newline at end of file
@@ -20,6 +20,8 @@
 // IN THE SOFTWARE.
 ////////////////////////////////////////////////////////////////////////////////
 
+#pragma once
+
 #include <stdint.h>
 
 struct rgba_surface
@@ -57,7 +59,9 @@ struct bc6h_enc_settings
 
 struct etc_enc_settings
 {
+    bool fast_mode;
     int fastSkipTreshold;
+    int refineIterations;
 };
 
 struct astc_enc_settings
@@ -92,6 +96,8 @@ extern "C" void GetProfile_bc6h_slow(bc6h_enc_settings* settings);
 extern "C" void GetProfile_bc6h_veryslow(bc6h_enc_settings* settings);
 
 // profiles for ETC
+extern "C" void GetProfile_etc_ultrafast(etc_enc_settings* settings);
+extern "C" void GetProfile_etc_fast(etc_enc_settings* settings);
 extern "C" void GetProfile_etc_slow(etc_enc_settings* settings);
 
 // profiles for ASTC
@@ -106,10 +112,10 @@ extern "C" void ReplicateBorders(rgba_surface* dst_slice, const rgba_surface* sr
 Notes:
     - input width and height need to be a multiple of block size
     - LDR input is 32 bit/pixel (sRGB), HDR is 64 bit/pixel (half float)
-        - for BC4 input is 8bit/pixel (R8), for BC5 input is 16bit/pixel (RG8)
+        - for BC4/EAC R11 input is 8bit/pixel (R8), for BC5/EAC RG11 input is 16bit/pixel (RG8)
     - dst buffer must be allocated with enough space for the compressed texture:
-        - 8 bytes/block for BC1/BC4/ETC1,
-        - 16 bytes/block for BC3/BC5/BC6H/BC7/ASTC
+        - 8 bytes/block for BC1/BC4/ETC1/ETC2/EAC R11,
+        - 16 bytes/block for BC3/BC5/BC6H/BC7/ETC2 RGBA/EAC RG11/ASTC
     - the blocks are stored in raster scan order (natural CPU texture layout)
     - use the GetProfile_* functions to select various speed/quality tradeoffs
     - the RGB profiles are slightly faster as they ignore the alpha channel
@@ -122,7 +128,33 @@ extern "C" void CompressBlocksBC5(const rgba_surface* src, uint8_t* dst);
 extern "C" void CompressBlocksBC6H(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings);
 extern "C" void CompressBlocksBC7(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings);
 extern "C" void CompressBlocksETC1(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings);
+extern "C" void CompressBlocksETC2(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings);
+extern "C" void CompressBlocksETC2RGBA(const rgba_surface* src, uint8_t* dst, etc_enc_settings* settings);
+extern "C" void CompressBlocksEACR11(const rgba_surface* src, uint8_t* dst);
+extern "C" void CompressBlocksEACRG11(const rgba_surface* src, uint8_t* dst);
 extern "C" void CompressBlocksASTC(const rgba_surface* src, uint8_t* dst, astc_enc_settings* settings);
 
+/*
+As above, also writing each block's squared error to errors, one float per
+block in raster order. BC7 errors are in 8 bit units over the channels the
+profile encodes, BC6H errors over RGB in the encoder's half float units
+(the half's bit pattern * 64/31).
+*/
+extern "C" void CompressBlocksBC6HError(const rgba_surface* src, uint8_t* dst, bc6h_enc_settings* settings, float* errors);
+extern "C" void CompressBlocksBC7Error(const rgba_surface* src, uint8_t* dst, bc7_enc_settings* settings, float* errors);
+
+/*
+ISA ids returned by ISPCIsa. ISPCInit picks the best one the CPU supports,
+ISPCSetIsa overrides it with any target up to ISPCSupportedIsa.
+*/
+#define ISPC_ISA_SSE2 0
+#define ISPC_ISA_SSE4 1
+#define ISPC_ISA_AVX2 2
+#define ISPC_ISA_AVX512SKX 3
+#define ISPC_ISA_AVX512ICL 4
+
 extern "C" void ISPCInit();
-extern "C" int ISPCIsa();
\ No newline at end of file
+extern "C" int ISPCIsa();
+extern "C" bool ISPCSetIsa(int isa);
+extern "C" int ISPCSupportedIsa();
+extern "C" void ISPCCpuId(int leaf, int subleaf, unsigned int regs[4]);
\ No newline at end of file
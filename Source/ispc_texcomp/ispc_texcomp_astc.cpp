@@ -21,6 +21,11 @@
 #include <vector>
 #include <limits>
 
+/* Dispatched to the selected target in ispc_texcomp.cpp */
+int ASTCProgramCount();
+void ASTCRank(ispc::rgba_surface* src, int xx, int yy, uint32_t* mode_buffer, int32_t* mode_counts, ispc::astc_enc_settings* settings);
+void ASTCEncode(ispc::rgba_surface* src, float* block_scores, uint8_t* dst, uint64_t* list, ispc::astc_enc_context* list_context, ispc::astc_enc_settings* settings);
+
 void GetProfile_astc_fast(astc_enc_settings* settings, int block_width, int block_height)
 {
     settings->block_width = block_width;
@@ -461,9 +466,9 @@ void pack_block(uint32_t data[4], astc_block* block)
     for (int i = 0; i < 4; i++) data[i] |= reverse_bits_32(rdata[3 - i]);    
 }
 
-void atsc_rank(const rgba_surface* src, int xx, int yy, uint32_t* mode_buffer, astc_enc_settings* settings)
+void atsc_rank(const rgba_surface* src, int xx, int yy, uint32_t* mode_buffer, int32_t* mode_counts, astc_enc_settings* settings)
 {
-    ispc::astc_rank_ispc((ispc::rgba_surface*)src, xx, yy, mode_buffer, (ispc::astc_enc_settings*)settings);
+    ASTCRank((ispc::rgba_surface*)src, xx, yy, mode_buffer, mode_counts, (ispc::astc_enc_settings*)settings);
 }
 
 extern "C" void pack_block_c(uint32_t data[4], ispc::astc_block* block)
@@ -492,7 +497,7 @@ void astc_encode(const rgba_surface* src, float* block_scores, uint8_t* dst, uin
 
     assert(sizeof(ispc::rgba_surface) == sizeof(rgba_surface));
     assert(sizeof(ispc::astc_enc_settings) == sizeof(astc_enc_settings));
-    ispc::astc_encode_ispc((ispc::rgba_surface*)src, block_scores, dst, list, &list_context, (ispc::astc_enc_settings*)settings);
+    ASTCEncode((ispc::rgba_surface*)src, block_scores, dst, list, &list_context, (ispc::astc_enc_settings*)settings);
 }
 
 void CompressBlocksASTC(const rgba_surface* src, uint8_t* dst, astc_enc_settings* settings)
@@ -500,35 +505,39 @@ void CompressBlocksASTC(const rgba_surface* src, uint8_t* dst, astc_enc_settings
     assert(src->height % settings->block_height == 0);
     assert(src->width % settings->block_width == 0);
     
-    assert(settings->block_height <= 8);
-    assert(settings->block_width <= 8);
+    assert(settings->block_height <= 12);
+    assert(settings->block_width <= 12);
     
     int tex_width = src->width / settings->block_width;
-    int programCount = ispc::get_programCount();
+    int programCount = ASTCProgramCount();
 
-    std::vector<float> block_scores(tex_width * src->height / settings->block_height);
+    // Scratch is per thread, so strips of one texture can be compressed
+    // concurrently. Every mode list is flushed and cleared below, so the
+    // lists are all zero again when the next call starts.
+    thread_local std::vector<float> block_scores;
+    thread_local std::vector<uint64_t> mode_lists;
+    thread_local std::vector<uint32_t> mode_buffer;
+    thread_local std::vector<int32_t> mode_counts;
 
-    for (int yy = 0; yy < src->height / settings->block_height; yy++)
-    for (int xx = 0; xx < tex_width; xx++)
-    {
-        block_scores[yy * tex_width + xx] = std::numeric_limits<float>::infinity();
-    }
+    block_scores.assign(tex_width * src->height / settings->block_height, std::numeric_limits<float>::infinity());
 
     int mode_list_size = 3334;
     int list_size = programCount;
-    std::vector<uint64_t> mode_lists(list_size * mode_list_size);
-    std::vector<uint32_t> mode_buffer(programCount * settings->fastSkipTreshold);
+    mode_lists.resize(list_size * mode_list_size);
+    mode_buffer.resize(programCount * settings->fastSkipTreshold);
+    mode_counts.resize(programCount);
 
     for (int yy = 0; yy < src->height / settings->block_height; yy++)
     for (int _x = 0; _x < (tex_width + programCount - 1) / programCount; _x++)
     {
         int xx = _x * programCount;
-        atsc_rank(src, xx, yy, mode_buffer.data(), settings);
+        atsc_rank(src, xx, yy, mode_buffer.data(), mode_counts.data(), settings);
         
         for (int i = 0; i < settings->fastSkipTreshold; i++)
         for (int k = 0; k < programCount; k++)
         {
             if (xx + k >= tex_width) continue;
+            if (i >= mode_counts[k]) continue;
                 
             uint32_t offset = (yy << 16) + (xx + k);
             uint32_t mode = mode_buffer[programCount * i + k];